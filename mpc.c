@@ -2477,17 +2477,35 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
 
 void mpc_ast_delete(mpc_ast_t *a) {
   
+  /* Nodes still to delete are kept on a stack rather than in calls, so
+     trees as deep as the parser can build are deleted too */
   int i;
+  int num = 0;
+  int slots = 0;
+  mpc_ast_t **nodes = NULL;
   
   if (a == NULL) { return; }
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+  
+  while (1) {
+    
+    if (num + a->children_num > slots) {
+      slots = ceil((num + a->children_num + 1) * 1.5);
+      nodes = realloc(nodes, sizeof(mpc_ast_t*) * slots);
+    }
+    for (i = 0; i < a->children_num; i++) {
+      nodes[num++] = a->children[i];
+    }
+    
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
+    
+    if (num == 0) { break; }
+    a = nodes[--num];
   }
   
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  free(nodes);
   
 }
 
@@ -1,4 +1,11 @@
+/* For MAP_ANONYMOUS, used by the JIT */
+#define _DEFAULT_SOURCE
+
 #include "mpc.h"
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 /* If compiling on windows, use these functions */
 #ifdef _WIN32
@@ -26,12 +33,9 @@ void add_history(char* unused) {}
 
 #endif
 
-#define LASSERT(args, cond, fmt, ...) \
-    if (!(cond)) { \
-        lval* err = lval_err(fmt, ##__VA_ARGS__); \
-        lval_del(args); \
-        return err; \
-    }
+/* Arguments are borrowed from the caller, so there is nothing to clean up */
+#define LASSERT(cond, fmt, ...) \
+    if (!(cond)) { return lval_err(fmt, ##__VA_ARGS__); }
 
 /* Forward type declerations */
 struct lval;
@@ -41,11 +45,17 @@ typedef struct lval lval;
 typedef struct lenv lenv;
 
 /* Possible lval types */
-enum { LVAL_NUM, LVAL_ERR , LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN };
+enum { LVAL_NUM, LVAL_ERR , LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_VEC, LVAL_NODE,
+       LVAL_LAMBDA, LVAL_PROTO };
+
+/* A bytecode opcode, or the address of its handler when the VM is direct
+ * threaded, or an operand */
+typedef intptr_t lcode;
 
 char* ltype_name(int t) {
     switch (t) {
         case LVAL_FUN:
+        case LVAL_LAMBDA:
             return "Function";
             break;
         case LVAL_NUM:
@@ -63,517 +73,5097 @@ char* ltype_name(int t) {
         case LVAL_QEXPR:
             return "Q-Expression";
             break;
+        case LVAL_VEC:
+            return "Vector";
+            break;
         default:
             return "Unknown";
             
     }
 }
 
-/* Function pointer for builtins */
-typedef lval*(*lbuiltin)(lenv*, lval*);
+/* Function pointer for builtins. Builtins are passed their n arguments as
+ * an array, which lives on the VM's operand stack or in the S-Expression
+ * being walked; they may take apart any argument they lval_own. */
+typedef lval*(*lbuiltin)(lenv*, lval**, int);
 
-/* Declare LISP val struct */
+/* Declare LISP val struct
+ *
+ * Only one payload is live at a time so they share a union, keeping an lval
+ * at 24 bytes on 64 bit machines. Errors and symbols store their text inline
+ * after the header, so they are a single allocation sized to fit, and so do
+ * vectors with their numbers. Lists keep their first few children inline in
+ * the same way and only need an array of their own once they outgrow it,
+ * and keep their hash after them (see lval_hash).
+ * Symbols are interned: there is exactly one LVAL_SYM per name (see lintern).
+ */
 struct lval{
-    int type;
-    long num;
+    unsigned char type;
+    unsigned short flags;
 
-    char* err;
-    char* sym;
-    lbuiltin fun;
-
-    /* Count and pointer to a list of lval* */
+    /* Count of cells in use by S/Q-Expressions, numbers in a vector, values
+     * a lambda captured or words of code in its body */
     int count;
-    struct lval** cell;
-};
 
-lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
-    v->num = x;
-    return v;
-}
+    union {
+        long num;
+        lbuiltin fun;
 
-lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+        /* Hash of a symbol's name */
+        unsigned long hash;
 
-    va_list va;
-    va_start(va, fmt);
+        /* Where a young value was copied to by a minor collection */
+        struct lval* forward;
 
-    /* Allocate 512 bytes of space */
-    v->err = malloc(512);
+        /* Capacity and pointer to a list of lval*. A list or vector in pool
+         * memory can be shared, refs counts its owners: bindings and parent
+         * lists. A view has no cells of its own, only a window onto those of
+         * the list it was taken from. */
+        struct {
+            union {
+                struct lval** cell;
+                /* Tree holding a long Q-Expression's elements (see lrrb) */
+                struct lval* root;
+                /* Compiled body a lambda closes over (see llambda) */
+                struct lval* proto;
+                /* Constants the compiled body of a lambda holds on to */
+                struct lval* consts;
+            };
+            union {
+                struct {
+                    int cap;
+                    int refs;
+                };
+                struct lval* base;
+            };
+        };
 
-    /* printf into the error string with a maximum of 511 characters */
-    vsnprintf(v->err, 511, fmt, va);
-    v->err = realloc(v->err, strlen(v->err+1));
+        /* Elements under a tree node and its height above the leaves.
+         * Nodes count their owners in refs, the same as lists, and so do
+         * lambdas and their compiled bodies. */
+        struct {
+            int size;
+            int height;
+        };
+    };
 
-    va_end(va);
-    return v;
+    /* Error message or symbol name, a vector's numbers, a list's inline
+     * cells, a lambda's captured values or the code of its body */
+    char str[];
+};
+
+/* Children a list holds inline, and the size of every list lval: the
+ * header, the inline cells and the list's cached hash (see lval_hash) */
+#define LVAL_INLINE_CELLS 4
+#define LVAL_LIST_SIZE (offsetof(lval, str) + sizeof(lval*) * LVAL_INLINE_CELLS + sizeof(unsigned long))
+
+/* Immediate integers
+ *
+ * Numbers that fit in 63 bits are never allocated. They are stored in the
+ * lval pointer itself, shifted left by one with the low bit set; real lvals
+ * are always at least 8 byte aligned so their low bit is clear. Only numbers
+ * outside that range get a boxed LVAL_NUM. Anything that may be handed a
+ * number must use lval_type/lval_numval rather than dereferencing it.
+ */
+
+#define LFIX_MIN (LONG_MIN >> 1)
+#define LFIX_MAX (LONG_MAX >> 1)
+
+static inline int lval_is_fix(lval* v) {
+    return ((uintptr_t)v & 1) != 0;
 }
 
-lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
-    return v;
+static inline lval* lfix_make(long x) {
+    return (lval*)(((uintptr_t)x << 1) | 1);
 }
 
-lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+static inline long lfix_val(lval* v) {
+    return (long)((intptr_t)v >> 1);
 }
 
-lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+static inline int lval_type(lval* v) {
+    return lval_is_fix(v) ? LVAL_NUM : v->type;
 }
 
-lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->fun = func;
-    return v;
+static inline long lval_numval(lval* v) {
+    return lval_is_fix(v) ? lfix_val(v) : v->num;
 }
 
-void lval_del(lval* v) {
-    switch(v->type) {
-        case LVAL_ERR:
-            free(v->err);
-            break;
+/* Slab allocator
+ *
+ * lvals and cell arrays are carved out of large slabs and recycled through
+ * per-type, per-size-class free lists so that building and tearing down
+ * expressions does not round trip through malloc/free for every element.
+ * Compile with -DLPOOL_MALLOC to hand everything straight to malloc, which
+ * is useful when running under valgrind or a sanitizer.
+ */
 
-        case LVAL_SYM:
-            free(v->sym);
-            break;
+#define LPOOL_SLAB_SIZE (64 * 1024)
 
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            for (int i = 0; i < v->count; i++) {
-                lval_del(v->cell[i]);
-            }
-            free(v->cell);
-        break;
-        case LVAL_FUN: break;
-    }
-    free(v);
-}
+/* Cell arrays come in power of two capacities from 1 to 2^(classes-1) */
+#define LPOOL_CELL_CLASSES 12
+#define LPOOL_CELL_MAX (1 << (LPOOL_CELL_CLASSES - 1))
 
-lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count-1] = x;
-    return v;
-}
+typedef struct lpool_free {
+    struct lpool_free* next;
+} lpool_free;
 
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("Invalid number.");
-}
+typedef struct lpool_slab {
+    struct lpool_slab* next;
+} lpool_slab;
 
-lval* lval_read(mpc_ast_t* t) {
-    /* If Symbol or Number, convert and return. */
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+/* Counters kept for every pool */
+typedef struct {
+    long allocs;     /* objects handed out */
+    long frees;      /* objects given back */
+    long live;       /* allocs - frees */
+    long peak;       /* highest value live has reached */
+    long sys_allocs; /* calls made to malloc on behalf of the pool */
+} lpool_stats;
 
-    /* If root (>) or sexpr then create an empty list */
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+typedef struct {
+    size_t size;
+    lpool_free* free;
+    char* bump;
+    char* end;
+    lpool_slab* slabs;
+    lpool_stats stats;
+} lpool;
+
+/* lvals are sizeof(lval) unless they carry an inline string or cells, in
+ * which case they use the smallest class that fits and fall back to malloc
+ * beyond that. Lists have a class of their own. */
+#define LPOOL_LVAL_CLASSES 8
+static lpool lval_pools[LPOOL_LVAL_CLASSES] = {
+    { .size = sizeof(lval) }, { .size = 32 }, { .size = 48 }, { .size = LVAL_LIST_SIZE },
+    { .size = 96 }, { .size = 128 }, { .size = 256 }, { .size = 512 }
+};
+static lpool_stats lval_large_stats;
+
+static lpool cell_pools[LPOOL_CELL_CLASSES];
+
+/* Arrays too big for any class go straight to malloc and are counted here */
+static lpool_stats cell_large_stats;
+
+static void lpool_count_alloc(lpool_stats* s) {
+    s->allocs++;
+    s->live++;
+    if (s->live > s->peak) { s->peak = s->live; }
+}
 
-    /* Fill in this list with any valid expression contained within */
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        x = lval_add(x, lval_read(t->children[i]));
+static void lpool_count_free(lpool_stats* s) {
+    s->frees++;
+    s->live--;
+}
+
+void* lpool_alloc(lpool* p) {
+    lpool_count_alloc(&p->stats);
+#ifdef LPOOL_MALLOC
+    p->stats.sys_allocs++;
+    return malloc(p->size);
+#else
+    /* Reuse a freed object if there is one */
+    if (p->free) {
+        lpool_free* f = p->free;
+        p->free = f->next;
+        return f;
     }
 
+    /* Otherwise bump allocate out of the current slab, grabbing a new one when full */
+    if (p->bump == NULL || p->bump + p->size > p->end) {
+        size_t bytes = sizeof(lpool_slab) + LPOOL_SLAB_SIZE;
+        if (p->size > LPOOL_SLAB_SIZE) { bytes = sizeof(lpool_slab) + p->size; }
+        lpool_slab* slab = malloc(bytes);
+        slab->next = p->slabs;
+        p->slabs = slab;
+        p->bump = (char*)(slab + 1);
+        p->end = (char*)slab + bytes;
+        p->stats.sys_allocs++;
+    }
+    void* x = p->bump;
+    p->bump += p->size;
     return x;
+#endif
 }
 
-void lval_print(lval* v);
+void lpool_release(lpool* p, void* x) {
+    lpool_count_free(&p->stats);
+#ifdef LPOOL_MALLOC
+    free(x);
+#else
+    lpool_free* f = x;
+    f->next = p->free;
+    p->free = f;
+#endif
+}
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
+/* Hand every slab of a pool back to the system */
+void lpool_destroy(lpool* p) {
+    while (p->slabs) {
+        lpool_slab* next = p->slabs->next;
+        free(p->slabs);
+        p->slabs = next;
+    }
+    p->free = NULL;
+    p->bump = NULL;
+    p->end = NULL;
+}
 
-        if (i != (v->count-1)) {
-            putchar(' ');
-        }
+/* Pool serving lvals of the given size, or NULL if it needs malloc */
+static lpool* lval_pool_for(size_t size) {
+    for (int i = 0; i < LPOOL_LVAL_CLASSES; i++) {
+        if (lval_pools[i].size >= size) { return &lval_pools[i]; }
     }
-    putchar(close);
+    return NULL;
 }
 
-/* Print an lval */
-void lval_print(lval* v) {
-    switch(v->type) {
-        case LVAL_NUM:
-            printf("%li", v->num);
-            break;
+void* lval_pool_alloc(size_t size) {
+    lpool* p = lval_pool_for(size);
+    if (p) { return lpool_alloc(p); }
+    lpool_count_alloc(&lval_large_stats);
+    lval_large_stats.sys_allocs++;
+    return malloc(size);
+}
 
-        case LVAL_ERR:
-            printf("Error: %s", v->err);
-            break;
+void lval_pool_release(void* x, size_t size) {
+    lpool* p = lval_pool_for(size);
+    if (p) {
+        lpool_release(p, x);
+        return;
+    }
+    lpool_count_free(&lval_large_stats);
+    free(x);
+}
 
-        case LVAL_SYM:
-            printf("%s", v->sym);
-            break;
+/* Index of the smallest class that holds n cells */
+static int lcells_class(int n) {
+    int c = 0;
+    while ((1 << c) < n) { c++; }
+    return c;
+}
 
-        case LVAL_SEXPR:
-            lval_expr_print(v, '(', ')');
-            break;
+/* Capacity actually handed out for a request of n cells */
+int lcells_capacity(int n) {
+    if (n <= 0) { return 0; }
+    if (n > LPOOL_CELL_MAX) { return n; }
+    return 1 << lcells_class(n);
+}
 
-        case LVAL_QEXPR:
-            lval_expr_print(v, '{', '}');
-            break;
-        case LVAL_FUN:
-            printf("<function>");
+lval** lcells_alloc(int cap) {
+    if (cap == 0) { return NULL; }
+    if (cap > LPOOL_CELL_MAX) {
+        lpool_count_alloc(&cell_large_stats);
+        cell_large_stats.sys_allocs++;
+        return malloc(sizeof(lval*) * cap);
     }
+
+    lpool* p = &cell_pools[lcells_class(cap)];
+    if (p->size == 0) { p->size = sizeof(lval*) * cap; }
+    return lpool_alloc(p);
 }
 
-/* Print an lval followed by a newline */
-void lval_println(lval* v) {
-    lval_print(v);
-    putchar('\n');
+void lcells_free(lval** cell, int cap) {
+    if (cell == NULL) { return; }
+    if (cap > LPOOL_CELL_MAX) {
+        lpool_count_free(&cell_large_stats);
+        free(cell);
+        return;
+    }
+    lpool_release(&cell_pools[lcells_class(cap)], cell);
 }
 
-lval* lval_pop(lval* v, int index) {
-    // get the item at index
-    lval* to_pop = v->cell[index];
+static void lpool_stats_add(lpool_stats* total, lpool_stats* s) {
+    total->allocs += s->allocs;
+    total->frees += s->frees;
+    total->live += s->live;
+    total->peak += s->peak;
+    total->sys_allocs += s->sys_allocs;
+}
 
-    /* Shift memory to cover up the spot we're taking */
-    memmove(&v->cell[index], &v->cell[index+1], sizeof(lval*) * (v->count-index-1));
+/* Counter API: totals for lval objects and for cell arrays of every size */
+void lval_alloc_stats(lpool_stats* lvals, lpool_stats* cells) {
+    *lvals = lval_large_stats;
+    for (int i = 0; i < LPOOL_LVAL_CLASSES; i++) {
+        lpool_stats_add(lvals, &lval_pools[i].stats);
+    }
+    *cells = cell_large_stats;
+    for (int i = 0; i < LPOOL_CELL_CLASSES; i++) {
+        lpool_stats_add(cells, &cell_pools[i].stats);
+    }
+}
 
-    v->count--;
+void lpool_stats_print(char* name, lpool_stats* s) {
+    printf("%-6s allocs: %li frees: %li live: %li peak: %li mallocs: %li\n",
+        name, s->allocs, s->frees, s->live, s->peak, s->sys_allocs);
+}
 
-    /* Reallocate memory. The order of the array has been reconstructed after
-     * the pop the memove call above.
-     */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return to_pop;
+void lval_alloc_stats_print(void) {
+    lpool_stats lvals, cells;
+    lval_alloc_stats(&lvals, &cells);
+    lpool_stats_print("lvals", &lvals);
+    lpool_stats_print("cells", &cells);
 }
 
-lval* lval_take(lval* v, int index) {
-    lval* x = lval_pop(v, index);
-    lval_del(v);
-    return x;
+void lval_alloc_cleanup(void) {
+    for (int i = 0; i < LPOOL_LVAL_CLASSES; i++) {
+        lpool_destroy(&lval_pools[i]);
+    }
+    for (int i = 0; i < LPOOL_CELL_CLASSES; i++) {
+        lpool_destroy(&cell_pools[i]);
+    }
 }
 
-lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+/* Evaluation region
+ *
+ * While a top level expression is evaluated every lval, cell array and
+ * string is bump allocated out of the region instead of the pools. Nothing
+ * in the region is freed on its own: lregion_end() drops all of it in one go
+ * once the result has been printed, so lval_del on a region value is a no-op.
+ * Values that have to outlive the expression are promoted to the pools by
+ * lenv_put.
+ *
+ * Pool values are immutable and reference counted. The evaluator only ever
+ * borrows them from the environment: lenv_get hands out the bound value
+ * itself, lval_del leaves them alone while a region is active, and anything
+ * that wants to change one takes a region copy first with lval_own. A value
+ * unbound mid expression may still be borrowed, so its release is deferred
+ * until the region ends.
+ */
 
-    switch (v->type) {
-        /* Copy functions and numbers directly */
-        case LVAL_FUN: x->fun = v->fun; break;
-        case LVAL_NUM: x->num = v->num; break;
+/* Flag bits kept in lval->flags */
+enum {
+    LFLAG_REGION = 1,  /* lives in the evaluation region */
+    LFLAG_ATOM = 2,    /* interned symbol */
+    LFLAG_GC = 4,      /* managed by the tracing collector */
+    LFLAG_SHARED = 8,  /* reachable from a binding or a frame, never changed in place */
+    LFLAG_MARK = 16,   /* reached during the current collection */
+    LFLAG_YOUNG = 32,  /* lives in the collector's nursery */
+    LFLAG_FWD = 64,    /* young value already copied out by a minor collection */
+    LFLAG_FRESH = 128, /* old value allocated since the last minor collection */
+    LFLAG_VIEW = 256,  /* list borrowing part of another list's cells */
+    LFLAG_RRB = 512,   /* Q-Expression backed by a tree rather than cells */
+    LFLAG_CONSED = 1024 /* canonical list in the hash-consing table */
+};
 
-        /* Copy strings using malloc and strcpy */
-        case LVAL_ERR:
-            /* point x->err to a new piece of memory that is the size of v->err + 1 */
-            x->err = malloc(strlen(v->err + 1));
-            strcpy(x->err, v->err);
-            break;
-        case LVAL_SYM:
-            /* Same things as ERR but act on the sym attr */
-            x->sym = malloc(strlen(v->sym + 1));
-            strcpy(x->sym, v->sym);
-            break;
+/* Bump allocation out of a list of chunks, all freed together. Shared by
+ * the evaluation region and the collector's nursery. */
 
-        /* Copy lists by copying each sub-expression individually */
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            x->count = v->count;
-            /* Note that the size of an lval pointer is being allocated. Not the size of an lval */
-            x->cell = malloc(sizeof(lval*) * x->count);
-            for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
-            break;
+#define LBUMP_CHUNK_SIZE (256 * 1024)
+
+typedef struct lbump_chunk {
+    struct lbump_chunk* next;
+    size_t size;
+} lbump_chunk;
+
+typedef struct {
+    lbump_chunk* chunks;
+    char* bump;
+    char* end;
+    long used;       /* bytes handed out since the last reset */
+    long bytes;      /* total bytes handed out */
+    long sys_allocs; /* chunks obtained from malloc */
+} lbump;
+
+void* lbump_alloc(lbump* b, size_t n) {
+    /* Keep everything 8 byte aligned */
+    n = (n + 7) & ~(size_t)7;
+
+    if (b->bump == NULL || b->bump + n > b->end) {
+        size_t size = n > LBUMP_CHUNK_SIZE ? n : LBUMP_CHUNK_SIZE;
+        lbump_chunk* c = malloc(sizeof(lbump_chunk) + size);
+        c->next = b->chunks;
+        c->size = size;
+        b->chunks = c;
+        b->bump = (char*)(c + 1);
+        b->end = b->bump + size;
+        b->sys_allocs++;
     }
 
+    void* x = b->bump;
+    b->bump += n;
+    b->used += n;
+    b->bytes += n;
     return x;
 }
 
-lval* lval_join(lval* x, lval* y) {
-    /* Pop everything from y and add it to x */
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+/* Free everything, keeping one regular sized chunk around for reuse */
+void lbump_reset(lbump* b) {
+    lbump_chunk* keep = NULL;
+    while (b->chunks) {
+        lbump_chunk* next = b->chunks->next;
+        if (keep == NULL && b->chunks->size == LBUMP_CHUNK_SIZE) {
+            keep = b->chunks;
+            keep->next = NULL;
+        } else {
+            free(b->chunks);
+        }
+        b->chunks = next;
     }
 
-    /* Cleanup the now empty */
-    lval_del(y);
-    return x;
+    b->chunks = keep;
+    b->bump = keep ? (char*)(keep + 1) : NULL;
+    b->end = keep ? b->bump + keep->size : NULL;
+    b->used = 0;
 }
 
-lval* lval_eval(lenv* e, lval* v);
+void lbump_destroy(lbump* b) {
+    lbump_reset(b);
+    free(b->chunks);
+    b->chunks = NULL;
+    b->bump = NULL;
+    b->end = NULL;
+}
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    /* Evaluate Children */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
+typedef struct {
+    long resets;     /* number of expressions evaluated in the region */
+    long peak;       /* most bytes used by a single expression */
+} lregion_stats;
 
-    /* Error checking */
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
-    }
+typedef struct {
+    int active;
+    lbump mem;
 
-    /* Check for empty expression */
-    if (v->count == 0) { return v; }
+    /* Pool values to release once nothing can be borrowing them */
+    lval** deferred;
+    int deferred_count;
+    int deferred_cap;
 
-    /* Check for single expression */
-    if (v-> count == 1) { return lval_take(v, 0); }
+    lregion_stats stats;
+} lregion;
 
-    /* Ensure first element is a function */
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        /* We don't have a function so we need to cleanup and return an error. */
-        lval_del(v);
-        lval_del(f);
-        return lval_err("S-expression does not start with a function!");
-    }
+static lregion region;
 
-    /* Call builtin with operator */
-    lval* result = f->fun(e, v);
-    lval_del(f);
-    return result;
+void lval_release(lval* v);
+
+void* lregion_alloc(size_t n) {
+    return lbump_alloc(&region.mem, n);
 }
 
-lval* lenv_get(lenv* e, lval* k);
+void lregion_begin(void) {
+    region.active = 1;
+}
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+/* Release v at the end of the region, or right away if there isn't one */
+void lregion_defer_release(lval* v) {
+    if (!region.active) {
+        lval_release(v);
+        return;
     }
-    /* Evaluate Sexpressions */
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    if (region.deferred_count == region.deferred_cap) {
+        region.deferred_cap = region.deferred_cap ? region.deferred_cap * 2 : 16;
+        region.deferred = realloc(region.deferred, sizeof(lval*) * region.deferred_cap);
     }
-
-    /* all other types remain unchanged */
-    return v;
+    region.deferred[region.deferred_count++] = v;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    /* sanity checks */
-    LASSERT(a, (a->count == 1), "Function 'tail' passed too many arguments!"); 
-
-    LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'tail' passed incorrect type!");
-
-    LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed '{}'!");
+/* Free everything allocated since lregion_begin */
+void lregion_end(void) {
+    for (int i = 0; i < region.deferred_count; i++) {
+        lval_release(region.deferred[i]);
+    }
+    region.deferred_count = 0;
 
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+    if (region.mem.used > region.stats.peak) { region.stats.peak = region.mem.used; }
+    lbump_reset(&region.mem);
+    region.stats.resets++;
+    region.active = 0;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+void lregion_cleanup(void) {
+    lregion_end();
+    lbump_destroy(&region.mem);
+    free(region.deferred);
+    region.deferred = NULL;
+    region.deferred_cap = 0;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT(a, (a->count == 1), "Function 'eval' passed too many arguments!"); 
+void lregion_stats_print(void) {
+    printf("region resets: %li bytes: %li peak: %li mallocs: %li\n",
+        region.stats.resets, region.mem.bytes, region.stats.peak, region.mem.sys_allocs);
+}
 
-    LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'eval' passed incorrect type!");
+/* Growable stack of lvals */
+typedef struct {
+    lval** items;
+    long count;
+    long cap;
+} lstack;
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+void lstack_push(lstack* s, lval* v) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->items = realloc(s->items, sizeof(lval*) * s->cap);
+    }
+    s->items[s->count++] = v;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, (a->cell[i]->type == LVAL_QEXPR), "Function 'join' passed incorrect type!");
-    }
+lval* lstack_pop(lstack* s) {
+    return s->items[--s->count];
+}
 
-    /* Remove the first q-exp. All other q-exps will have each of their elements
-     * popped and added to it. */
-    lval* x = lval_pop(a, 0);
-    while(a->count) {
-        x = lval_join(x, lval_pop(a, 0));
-    }
+void lstack_free(lstack* s) {
+    free(s->items);
+    s->items = NULL;
+    s->count = 0;
+    s->cap = 0;
+}
 
-    lval_del(a);
-    return x;
+/* items, an array of count elements of size bytes and room for *cap, with
+ * room for one more */
+static void* lgrow(void* items, long count, long* cap, size_t size) {
+    if (count < *cap) { return items; }
+    *cap = *cap ? *cap * 2 : 64;
+    return realloc(items, size * *cap);
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+/* Operand stack of the bytecode VM, which the collector scans for roots */
+static lstack lvm_stack;
 
-    /* Make sure all arguments are numbers */
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("Cannot operate on non-numbers!");
-        }
-    }
+/* Tracing collector
+ *
+ * Enabled with --gc, instead of evaluating each line in a region. lval_del
+ * does nothing in this mode; values go once they can no longer be reached
+ * from the environment or from the evaluator's root stack, which holds each
+ * S-Expression while lval_eval is working on it.
+ *
+ * The heap has two generations. New values are bump allocated in the
+ * nursery. When a top level expression is finished the evaluator holds
+ * nothing, so a minor collection copies whatever the environment can still
+ * reach out of the nursery into the pools and throws the nursery away in one
+ * go. lenv_put is the write barrier: it remembers every symbol it binds to a
+ * value that may point into the nursery, and those bindings are the minor
+ * collection's only roots. Old values never point into the nursery, since
+ * everything bound is immutable (see below), except for values allocated old
+ * during the current expression because the nursery was full; those are
+ * flagged LFLAG_FRESH and scanned too.
+ *
+ * The old generation is tracked in a table and collected by mark and sweep,
+ * marking through the nursery without sweeping it. Major collections can
+ * happen on entry to lval_eval, after its expression has been pushed, so
+ * builtins can hold on to unrooted values between evaluations. Nothing in
+ * the nursery moves except at the end of a top level expression.
+ *
+ * Nothing is refcounted, so lenv_put and lenv_get store and return values
+ * without copying them. Anything bound in the environment is flagged
+ * LFLAG_SHARED, all the way down, and lval_own copies it before it is changed.
+ */
 
-    /* Pop the first element */
-    lval* x = lval_pop(a, 0);
+/* Smallest old generation, in objects, worth collecting. Build with a tiny
+ * value to stress the collector. */
+#ifndef LGC_MIN_THRESHOLD
+#define LGC_MIN_THRESHOLD (64 * 1024)
+#endif
 
-    /* If no arguments and op is substraction, perform negation */
-    if (strcmp(op, "-") == 0 && a->count == 0) { x->num = -x->num; }
+/* Bytes of nursery one top level expression can use before new values are
+ * allocated straight into the old generation */
+#ifndef LGC_NURSERY_SIZE
+#define LGC_NURSERY_SIZE (4 * 1024 * 1024)
+#endif
 
-    while (a->count > 0) {
-        /* Pop the next element */
-        lval* y = lval_pop(a, 0);
+/* Pause times, bucketed by order of magnitude from under 10us up */
+#define LGC_PAUSE_BUCKETS 6
 
-        /* Perform operation */
-        if (strcmp(op, "+") == 0) {
-            x->num += y->num;
-        }
+typedef struct {
+    long count;
+    double total;
+    double max;
+    long buckets[LGC_PAUSE_BUCKETS];
+} lgc_pauses;
 
-        if (strcmp(op, "-") == 0) {
-            x->num -= y->num;
-        }
+typedef struct {
+    long collections;
+    long freed;      /* old objects swept in total */
+    long live;       /* old objects that survived the last collection */
+    long minors;
+    long promoted;   /* values copied out of the nursery in total */
+    lgc_pauses major_pauses;
+    lgc_pauses minor_pauses;
+} lgc_stats;
 
-        if (strcmp(op, "*") == 0) {
-            x->num *= y->num;
-        }
+typedef struct {
+    int enabled;
+    lenv* env;
 
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero!");
-                break;
-            }
-            x->num /= y->num;
-        }
-        lval_del(y);
-    }
-    lval_del(a);
-    return x;
-}
+    lbump nursery;
 
-lval* builtin_head(lenv* e, lval* a) {
-    /* sanity checks */
-    LASSERT(a, (a->count == 1), "Function 'head' passed too many arguments! Got %i, expected %i", a->count, 1); 
+    /* Every old object, compacted by each sweep. Those from epoch_start on
+     * were allocated since the last minor collection. */
+    lstack objects;
+    long epoch_start;
 
-    LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'head' passed incorrect type!");
+    /* Collect the old generation once it reaches this many objects */
+    long threshold;
 
-    LASSERT(a, (a->cell[0]->count != 0), "Function 'head' passed '{}'!");
-    lval* v = lval_take(a, 0);
-    /* Get rid of everything but the first element */
-    while(v->count > 1) { lval_del(lval_pop(v, 1)); }
-    return v;
-}
+    /* Allocate straight into the old generation, for values that must
+     * never move (see builtin_lambda) */
+    int tenure;
 
-lval* builtin_len(lenv* e, lval* a) {
-    /* sanity checks */
-    LASSERT(a, (a->count == 1), "Function 'len' passed too many arguments!");
+    /* Expressions being evaluated */
+    lstack roots;
 
-    LASSERT(a, (a->cell[0]->count != 0), "Function 'len' passed '{}'!");
-    return lval_num(a->cell[0]->count);
-}
+    /* Symbols bound to values that may point into the nursery */
+    lstack remembered;
 
-lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
+    /* Work lists used while marking and promoting, and young values a major
+     * collection marked and has to unmark again */
+    lstack marks;
+    lstack young_marked;
 
-/* Declare environment struct. */
-struct lenv {
-    int count;
-    char** syms;
-    lval** vals;
-};
+    lgc_stats stats;
+} lgc_heap;
 
-lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
+static lgc_heap gc;
+
+void lgc_push_root(lval* v) {
+    lstack_push(&gc.roots, v);
 }
 
-void lenv_del(lenv* e) {
-    /* Loop through each symbol and val and free/delete */
-    for (int i = 0; i < e->count; i++) {
-       free(e->syms[i]);
-       lval_del(e->vals[i]);
+void lgc_pop_root(void) {
+    gc.roots.count--;
+}
+
+lval* lgc_alloc(size_t size) {
+    lval* v;
+    if (!gc.tenure && gc.nursery.used + (long)size <= LGC_NURSERY_SIZE) {
+        v = lbump_alloc(&gc.nursery, size);
+        v->flags = LFLAG_GC | LFLAG_YOUNG;
+    } else {
+        v = lval_pool_alloc(size);
+        v->flags = LFLAG_GC | LFLAG_FRESH;
+        lstack_push(&gc.objects, v);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    return v;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-    /* Iterate over all items in the environment */
-    for (int i = 0; i < e->count; i++) {
-        /* check if the stored string matches the symbol string. If it does, return a copy */ 
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
+/* Allocate an lval from the region while one is active, otherwise from the pools */
+lval* lval_alloc(int type, size_t size) {
+    lval* v;
+    if (region.active) {
+        v = lregion_alloc(size);
+        v->flags = LFLAG_REGION;
+    } else if (gc.enabled) {
+        v = lgc_alloc(size);
+    } else {
+        v = lval_pool_alloc(size);
+        v->flags = 0;
     }
-    return lval_err("unbound symbol '%s'", k->sym);
+    v->type = type;
+    return v;
 }
 
-void lenv_put(lenv* e, lval* k, lval*v) {
-    /*Check to see if the variable already exists */
-    for (int i = 0; i < e->count; i++) {
-        /* If variable is found, delete val at that position and replace with new value */
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+/* Bytes taken up by v, including any inline error message or numbers */
+size_t lval_size(lval* v) {
+    if (v->type == LVAL_ERR) {
+        return offsetof(lval, str) + strlen(v->str) + 1;
+    }
+    if (v->type == LVAL_VEC) {
+        return offsetof(lval, str) + sizeof(long) * v->count;
+    }
+    if (v->type == LVAL_NODE || v->type == LVAL_LAMBDA) {
+        return offsetof(lval, str) + sizeof(lval*) * v->count;
+    }
+    if (v->type == LVAL_PROTO) {
+        return offsetof(lval, str) + sizeof(lcode) * v->count;
     }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        return LVAL_LIST_SIZE;
+    }
+    return sizeof(lval);
+}
 
-    /* If no existing entry is found, allocate space for a new entry */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+/* Cell arrays live wherever the lval that owns them lives */
+lval** lval_cells_alloc(lval* v, int cap) {
+    if (v->flags & LFLAG_REGION) {
+        return cap ? lregion_alloc(sizeof(lval*) * cap) : NULL;
+    }
+    if (v->flags & LFLAG_YOUNG) {
+        return cap ? lbump_alloc(&gc.nursery, sizeof(lval*) * cap) : NULL;
+    }
+    return lcells_alloc(cap);
+}
 
-    /* Copy contents of lval and symbol string into new location */
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+/* Cells kept after v's header rather than in an array of their own */
+static lval** lval_inline_cells(lval* v) {
+    return (lval**)v->str;
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-    LASSERT(a, (a->cell[0]->type == LVAL_QEXPR), "Function 'def' passed incorrect type!");
+/* Structural hash of list v, kept after its inline cells, or 0 until it
+ * is next worked out. Anything that changes a list's cells clears it with
+ * lval_unhash. */
+static inline unsigned long* lval_hash_cache(lval* v) {
+    return (unsigned long*)(v->str + sizeof(lval*) * LVAL_INLINE_CELLS);
+}
 
-    /* First arg is a symbol list*/
-    lval* syms = a->cell[0];
+static inline void lval_unhash(lval* v) {
+    *lval_hash_cache(v) = 0;
+}
 
-    /* Make sure all memebers of syms is in fact a symbol */
-    for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function 'def' cannot define non-symbol!");
+/* Give list v room for n children: inline if they fit, otherwise an array
+ * sized like any other */
+void lval_cells_reserve(lval* v, int n) {
+    if (n <= LVAL_INLINE_CELLS) {
+        v->cap = LVAL_INLINE_CELLS;
+        v->cell = lval_inline_cells(v);
+        return;
     }
+    v->cap = lcells_capacity(n);
+    v->cell = lval_cells_alloc(v, v->cap);
+}
 
-    /* Check for correct number of symbols and values */
-    LASSERT(a, (syms->count == a->count-1), "Function 'def' cannot define incorrect number of values to symbols!");
-
-    /* Assign copies to symbols */
-    for (int i = 0; i < syms->count; i++) {
-        lenv_put(e, syms->cell[i], a->cell[i+1]);
-    }
+void lval_cells_free(lval* v) {
+    if (v->flags & (LFLAG_REGION | LFLAG_YOUNG | LFLAG_VIEW)) { return; }
+    if (v->cell == lval_inline_cells(v)) { return; }
+    lcells_free(v->cell, v->cap);
+}
 
-    lval_del(a);
-    return lval_sexpr();
+/* An empty list of the given type with room for n children */
+lval* lval_list(int type, int n) {
+    lval* v = lval_alloc(type, LVAL_LIST_SIZE);
+    v->count = 0;
+    v->refs = 1;
+    lval_unhash(v);
+    lval_cells_reserve(v, n);
+    return v;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* key = lval_sym(name);
-    lval* value = lval_fun(func);
-    lenv_put(e, key, value);
-    lval_del(key);
-    lval_del(value);
+/* Errors and symbols: the header followed by the string */
+lval* lval_str(int type, char* s) {
+    size_t n = strlen(s) + 1;
+    lval* v = lval_alloc(type, offsetof(lval, str) + n);
+    memcpy(v->str, s, n);
+    return v;
+}
+
+lval* lval_num(long x) {
+    if (x >= LFIX_MIN && x <= LFIX_MAX) { return lfix_make(x); }
+
+    /* Too big for an immediate, box it */
+    lval* v = lval_alloc(LVAL_NUM, sizeof(lval));
+    v->num = x;
+    return v;
+}
+
+lval* lval_err(char* fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+
+    /* printf into a 512 byte buffer with a maximum of 511 characters */
+    char buf[512];
+    vsnprintf(buf, 511, fmt, va);
+
+    va_end(va);
+    return lval_str(LVAL_ERR, buf);
+}
+
+/* Symbol interning
+ *
+ * Every symbol name maps to a single atom: an LVAL_SYM flagged LFLAG_ATOM
+ * that lives until lintern_cleanup. Names are looked up once, when the
+ * symbol is read, and from then on symbols are compared by pointer. Atoms
+ * are never copied or deleted, so lval_sym allocates nothing after the first
+ * time a name is seen.
+ */
+
+typedef struct {
+    int count;
+    int size;
+    lval** atoms;
+} lintern_table;
+
+static lintern_table interned;
+
+/* FNV-1a */
+unsigned long lintern_hash(char* s) {
+    unsigned long h = 14695981039346656037UL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void lintern_insert(lval* atom) {
+    unsigned long i = atom->hash & (interned.size - 1);
+    while (interned.atoms[i]) { i = (i + 1) & (interned.size - 1); }
+    interned.atoms[i] = atom;
+}
+
+/* Double the table, rehashing every atom into it */
+static void lintern_grow(void) {
+    int old_size = interned.size;
+    lval** old = interned.atoms;
+
+    interned.size = old_size ? old_size * 2 : 256;
+    interned.atoms = calloc(interned.size, sizeof(lval*));
+    for (int i = 0; i < old_size; i++) {
+        if (old[i]) { lintern_insert(old[i]); }
+    }
+    free(old);
+}
+
+lval* lintern(char* s) {
+    unsigned long hash = lintern_hash(s);
+
+    if (interned.size) {
+        unsigned long i = hash & (interned.size - 1);
+        while (interned.atoms[i]) {
+            lval* a = interned.atoms[i];
+            if (a->hash == hash && strcmp(a->str, s) == 0) { return a; }
+            i = (i + 1) & (interned.size - 1);
+        }
+    }
+
+    /* Keep the load factor at or under a half */
+    if ((interned.count + 1) * 2 > interned.size) { lintern_grow(); }
+
+    size_t n = strlen(s) + 1;
+    lval* atom = malloc(offsetof(lval, str) + n);
+    atom->type = LVAL_SYM;
+    atom->flags = LFLAG_ATOM;
+    atom->hash = hash;
+    memcpy(atom->str, s, n);
+
+    lintern_insert(atom);
+    interned.count++;
+    return atom;
+}
+
+void lintern_cleanup(void) {
+    for (int i = 0; i < interned.size; i++) {
+        free(interned.atoms[i]);
+    }
+    free(interned.atoms);
+    interned.atoms = NULL;
+    interned.size = 0;
+    interned.count = 0;
+}
+
+lval* lval_sym(char* s) {
+    return lintern(s);
+}
+
+lval* lval_sexpr(void) {
+    return lval_list(LVAL_SEXPR, 0);
+}
+
+lval* lval_qexpr(void) {
+    return lval_list(LVAL_QEXPR, 0);
+}
+
+/* A list of the count elements of v starting at start, sharing v's cells
+ * rather than copying them, so that taking the head, tail or a slice of a
+ * list is constant time. A view always points at the list that owns the
+ * cells, never at another view.
+ *
+ * Views are only made while evaluating, where they are region values or
+ * collected ones, and nothing changes their cells in place: lval_own gives
+ * back an owned copy of a view, and lval_promote and minor collections copy
+ * views they come across into lists of their own. Under the collector a
+ * view keeps the list it borrows from alive. */
+lval* lval_view(lval* v, int start, int count) {
+    lval* x = lval_alloc(v->type, LVAL_LIST_SIZE);
+    x->flags |= LFLAG_VIEW;
+    x->count = count;
+    x->cell = v->cell + start;
+    x->base = (v->flags & LFLAG_VIEW) ? v->base : v;
+    lval_unhash(x);
+    return x;
+}
+
+lval* lval_fun(lbuiltin func) {
+    lval* v = lval_alloc(LVAL_FUN, sizeof(lval));
+    v->fun = func;
+    return v;
+}
+
+lval* lval_share(lval* v);
+
+/* Lambdas: the header followed by the n values captured from the scopes
+ * around them, which the caller fills in. The compiled body, proto, is
+ * shared by every closure made from the same lambda; closures in the
+ * region borrow it, like everything else they point at. */
+lval* lval_lambda(lval* proto, int n) {
+    lval* v = lval_alloc(LVAL_LAMBDA, offsetof(lval, str) + sizeof(lval*) * n);
+    v->count = n;
+    v->refs = 1;
+    v->proto = (v->flags & LFLAG_REGION) ? proto : lval_share(proto);
+    return v;
+}
+
+static inline lval** lval_captures(lval* v) {
+    return (lval**)v->str;
+}
+
+/* A compiled body holds its code inline, and in consts its parameters, the
+ * body it was compiled from, the names it captures and then any constants
+ * its code needs to keep alive */
+static inline lcode* lproto_code(lval* p) {
+    return (lcode*)p->str;
+}
+
+static inline lval* lproto_formals(lval* p) { return p->consts->cell[0]; }
+static inline lval* lproto_body(lval* p) { return p->consts->cell[1]; }
+static inline lval* lproto_frees(lval* p) { return p->consts->cell[2]; }
+
+/* Vectors: the header followed by n longs, packed one after the other so
+ * that they can be worked through with SIMD. Their contents are left to the
+ * caller to fill in. */
+lval* lval_vec(int n) {
+    lval* v = lval_alloc(LVAL_VEC, offsetof(lval, str) + sizeof(long) * n);
+    v->count = n;
+    v->refs = 1;
+    return v;
+}
+
+static inline long* lval_vec_items(lval* v) {
+    return (long*)v->str;
+}
+
+/* Persistent vectors
+ *
+ * Run with --rrb to back long Q-Expressions with relaxed radix balanced
+ * trees. Joining, slicing or taking the tail of a Q-Expression then gives
+ * one backed by a tree whenever the result is longer than LRRB_BRANCH
+ * elements, instead of a flat array of cells. The elements sit in leaves
+ * of up to LRRB_BRANCH each, every node above a leaf holds up to
+ * LRRB_BRANCH nodes, and each node knows how many elements are under it.
+ * Nodes never change once built, so a new tree shares all of an old one
+ * but the nodes along the edges an operation cut through, and indexing,
+ * slicing and joining take time in proportion to the height of the tree.
+ *
+ * The tree is relaxed: a node's children need not be full, so finding an
+ * element scans the sizes of the children it passes instead of dividing by
+ * a fixed radix. All the children of a node are the same height, though,
+ * and joins share out the nodes either side of the seam again so that no
+ * more than LRRB_EXTRA nodes are spent at each height over the fewest that
+ * could hold them. That keeps nodes full enough for the height to stay
+ * logarithmic however many joins and slices a tree went through.
+ *
+ * Nodes are lvals of type LVAL_NODE that never reach the user, so they are
+ * allocated, promoted, released and collected like any other lval. A
+ * Q-Expression backed by a tree is flagged LFLAG_RRB and points at the
+ * root. Anything that needs its cells flattens it first: lval_own gives
+ * back a flat copy, and so does lval_flat.
+ */
+
+#define LRRB_BRANCH 32
+#define LRRB_EXTRA 2
+
+static int lrrb_enabled;
+
+static inline lval** lrrb_kids(lval* v) {
+    return (lval**)v->str;
+}
+
+/* Node height above the leaves, made from the children in a then those in b */
+static lval* lrrb_node(int height, lval** a, int na, lval** b, int nb) {
+    lval* v = lval_alloc(LVAL_NODE, offsetof(lval, str) + sizeof(lval*) * (na + nb));
+    v->count = na + nb;
+    v->height = height;
+    v->refs = 1;
+    if (na) { memcpy(lrrb_kids(v), a, sizeof(lval*) * na); }
+    if (nb) { memcpy(lrrb_kids(v) + na, b, sizeof(lval*) * nb); }
+
+    v->size = v->count;
+    if (height) {
+        v->size = 0;
+        for (int i = 0; i < v->count; i++) { v->size += lrrb_kids(v)[i]->size; }
+    }
+    return v;
+}
+
+/* Tree of the n > 0 elements in cells, built a level at a time */
+lval* lrrb_build(lval** cells, int n) {
+    int count = (n + LRRB_BRANCH - 1) / LRRB_BRANCH;
+    lval** level = malloc(sizeof(lval*) * count);
+    for (int i = 0; i < count; i++) {
+        int k = n - i * LRRB_BRANCH < LRRB_BRANCH ? n - i * LRRB_BRANCH : LRRB_BRANCH;
+        level[i] = lrrb_node(0, cells + i * LRRB_BRANCH, k, NULL, 0);
+    }
+
+    for (int height = 1; count > 1; height++) {
+        int up = (count + LRRB_BRANCH - 1) / LRRB_BRANCH;
+        for (int i = 0; i < up; i++) {
+            int k = count - i * LRRB_BRANCH < LRRB_BRANCH ? count - i * LRRB_BRANCH : LRRB_BRANCH;
+            level[i] = lrrb_node(height, level + i * LRRB_BRANCH, k, NULL, 0);
+        }
+        count = up;
+    }
+
+    lval* root = level[0];
+    free(level);
+    return root;
+}
+
+lval* lrrb_get(lval* v, int i) {
+    while (v->height) {
+        lval** k = lrrb_kids(v);
+        while (i >= (*k)->size) { i -= (*k)->size; k++; }
+        v = *k;
+    }
+    return lrrb_kids(v)[i];
+}
+
+/* Tree at the height of v of the elements under it from start up to but not
+ * including end, where start < end. Only the nodes the two ends fall in are
+ * copied. */
+static lval* lrrb_slice_node(lval* v, int start, int end) {
+    if (start == 0 && end == v->size) { return v; }
+
+    lval** k = lrrb_kids(v);
+    if (v->height == 0) { return lrrb_node(0, k + start, end - start, NULL, 0); }
+
+    /* The children holding the first and last elements wanted, and the
+     * number of elements before each */
+    int first = 0;
+    int before_first = 0;
+    while (start >= before_first + k[first]->size) { before_first += k[first++]->size; }
+    int last = first;
+    int before_last = before_first;
+    while (end > before_last + k[last]->size) { before_last += k[last++]->size; }
+
+    lval* kids[LRRB_BRANCH];
+    int n = 0;
+    if (first == last) {
+        kids[n++] = lrrb_slice_node(k[first], start - before_first, end - before_first);
+        return lrrb_node(v->height, kids, n, NULL, 0);
+    }
+    kids[n++] = lrrb_slice_node(k[first], start - before_first, k[first]->size);
+    for (int i = first + 1; i < last; i++) { kids[n++] = k[i]; }
+    kids[n++] = lrrb_slice_node(k[last], 0, end - before_last);
+    return lrrb_node(v->height, kids, n, NULL, 0);
+}
+
+/* The root of v with any chain of only children above it cut off */
+static lval* lrrb_trim(lval* v) {
+    while (v->height && v->count == 1) { v = lrrb_kids(v)[0]; }
+    return v;
+}
+
+/* Tree of the elements under v from start up to but not including end,
+ * where start < end, no taller than it needs to be */
+lval* lrrb_slice(lval* v, int start, int end) {
+    return lrrb_trim(lrrb_slice_node(v, start, end));
+}
+
+/* Concatenation plan for the n nodes in all, all at one height: how many
+ * children each node should hold once they are shared out again, returning
+ * how many nodes that takes. Until there are no more than LRRB_EXTRA nodes
+ * over the fewest that could hold everything, the first node short of full
+ * is emptied into the ones after it. Full nodes are left alone. */
+static int lrrb_plan(lval** all, int n, int* sizes) {
+    int total = 0;
+    for (int i = 0; i < n; i++) { total += sizes[i] = all[i]->count; }
+
+    int fewest = (total + LRRB_BRANCH - 1) / LRRB_BRANCH;
+    int i = 0;
+    while (n > fewest + LRRB_EXTRA) {
+        while (sizes[i] > LRRB_BRANCH - 1) { i++; }
+        int left = sizes[i];
+        do {
+            int fill = left + sizes[i + 1] < LRRB_BRANCH ? left + sizes[i + 1] : LRRB_BRANCH;
+            left += sizes[i + 1] - fill;
+            sizes[i++] = fill;
+        } while (left > 0);
+        memmove(sizes + i, sizes + i + 1, sizeof(int) * (n - i - 1));
+        n--;
+        i--;
+    }
+    return n;
+}
+
+/* Node two taller than the n nodes in all, over the children of those
+ * nodes shared out by lrrb_plan: an only child holding them all, or if they
+ * need more than one node, two holding them between them. Nodes the plan
+ * leaves as they were are kept rather than copied. */
+static lval* lrrb_rebalance(lval** all, int n) {
+    int sizes[2 * LRRB_BRANCH];
+    lval* out[2 * LRRB_BRANCH];
+    int m = lrrb_plan(all, n, sizes);
+
+    int height = all[0]->height;
+    int src = 0;
+    int at = 0;
+    for (int j = 0; j < m; j++) {
+        if (at == 0 && all[src]->count == sizes[j]) {
+            out[j] = all[src++];
+            continue;
+        }
+        lval* kids[LRRB_BRANCH];
+        int k = 0;
+        while (k < sizes[j]) {
+            int take = all[src]->count - at < sizes[j] - k ? all[src]->count - at : sizes[j] - k;
+            memcpy(kids + k, lrrb_kids(all[src]) + at, sizeof(lval*) * take);
+            k += take;
+            at += take;
+            if (at == all[src]->count) { src++; at = 0; }
+        }
+        out[j] = lrrb_node(height, kids, k, NULL, 0);
+    }
+
+    if (m <= LRRB_BRANCH) {
+        lval* parent = lrrb_node(height + 1, out, m, NULL, 0);
+        return lrrb_node(height + 2, &parent, 1, NULL, 0);
+    }
+    lval* halves[2] = {
+        lrrb_node(height + 1, out, LRRB_BRANCH, NULL, 0),
+        lrrb_node(height + 1, out + LRRB_BRANCH, m - LRRB_BRANCH, NULL, 0)
+    };
+    return lrrb_node(height + 2, halves, 2, NULL, 0);
+}
+
+/* Tree one taller than the taller of a and b of the elements under a
+ * followed by those under b. The nodes down the facing edges are joined
+ * from the bottom up: at each height the children either side of the seam
+ * are pooled with what the height below gave back and shared out again by
+ * lrrb_rebalance, so the tree stays close to as short as it could be. */
+static lval* lrrb_concat_node(lval* a, lval* b) {
+    lval* all[2 * LRRB_BRANCH];
+    int n = 0;
+
+    /* Two leaves are merged if they fit in one, and otherwise left for the
+     * height above to share out */
+    if (a->height == 0 && b->height == 0) {
+        if (a->count + b->count <= LRRB_BRANCH) {
+            all[n++] = lrrb_node(0, lrrb_kids(a), a->count, lrrb_kids(b), b->count);
+        } else {
+            all[n++] = a;
+            all[n++] = b;
+        }
+        return lrrb_node(1, all, n, NULL, 0);
+    }
+
+    /* The taller tree's edge child is joined with the other tree, or when
+     * both are as tall, the two edge children with each other */
+    lval* mid = lrrb_concat_node(a->height >= b->height ? lrrb_kids(a)[a->count - 1] : a,
+                                 b->height >= a->height ? lrrb_kids(b)[0] : b);
+    if (a->height >= b->height) {
+        memcpy(all, lrrb_kids(a), sizeof(lval*) * (a->count - 1));
+        n = a->count - 1;
+    }
+    memcpy(all + n, lrrb_kids(mid), sizeof(lval*) * mid->count);
+    n += mid->count;
+    if (b->height >= a->height) {
+        memcpy(all + n, lrrb_kids(b) + 1, sizeof(lval*) * (b->count - 1));
+        n += b->count - 1;
+    }
+    return lrrb_rebalance(all, n);
+}
+
+/* Tree of the elements under a followed by those under b */
+lval* lrrb_concat(lval* a, lval* b) {
+    return lrrb_trim(lrrb_concat_node(a, b));
+}
+
+/* Copy the elements under v to out, returning how many there were */
+int lrrb_flatten(lval* v, lval** out) {
+    if (v->height == 0) {
+        memcpy(out, lrrb_kids(v), sizeof(lval*) * v->count);
+        return v->count;
+    }
+    int n = 0;
+    for (int i = 0; i < v->count; i++) { n += lrrb_flatten(lrrb_kids(v)[i], out + n); }
+    return n;
+}
+
+/* Q-Expression of the elements under root: backed by the tree if it is
+ * long, and flattened into cells of its own if not */
+lval* lval_rrb(lval* root) {
+    lval* x = lval_qexpr();
+    x->count = root->size;
+    if (x->count <= LRRB_BRANCH) {
+        lval_cells_reserve(x, x->count);
+        lrrb_flatten(root, x->cell);
+        return x;
+    }
+    x->flags |= LFLAG_RRB;
+    x->root = root;
+    return x;
+}
+
+/* Tree of the elements of non-empty Q-Expression v, built if it is flat */
+lval* lrrb_of(lval* v) {
+    return (v->flags & LFLAG_RRB) ? v->root : lrrb_build(v->cell, v->count);
+}
+
+/* Traversals
+ *
+ * Copying, promoting, releasing, printing and comparing values walk
+ * everything under them. They share one explicit stack of frames, each a
+ * value whose children are being worked through, so that however deeply
+ * data is nested it costs heap rather than C stack. Walks nest: each one
+ * only pops the frames it pushed itself.
+ *
+ * Children can be scattered around memory, so a walk prefetches the child
+ * LWALK_AHEAD places on while the current one is handled.
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define lprefetch(p) __builtin_prefetch(p)
+#else
+#define lprefetch(p) ((void)(p))
+#endif
+
+#define LWALK_AHEAD 4
+
+typedef struct {
+    lval* v;
+    lval** kids;
+    int n;
+    int i;
+    /* Value walked alongside v, and its children: the one compared with
+     * it, or the one it is being copied from */
+    lval* w;
+    lval** with;
+} lwalk_frame;
+
+static struct {
+    lwalk_frame* items;
+    long count;
+    long cap;
+} lwalk;
+
+/* Start working through the n children of v */
+static lwalk_frame* lwalk_push(lval* v, lval** kids, int n) {
+    lwalk.items = lgrow(lwalk.items, lwalk.count, &lwalk.cap, sizeof(lwalk_frame));
+    lwalk_frame* f = &lwalk.items[lwalk.count++];
+    f->v = v;
+    f->kids = kids;
+    f->n = n;
+    f->i = 0;
+    f->w = NULL;
+    f->with = NULL;
+    return f;
+}
+
+/* Slot of the next child of the innermost value, or NULL once they have
+ * all been seen, leaving its frame for the caller to pop */
+static lval** lwalk_next(void) {
+    lwalk_frame* f = &lwalk.items[lwalk.count - 1];
+    if (f->i == f->n) { return NULL; }
+    if (f->i + LWALK_AHEAD < f->n) { lprefetch(f->kids[f->i + LWALK_AHEAD]); }
+    return &f->kids[f->i++];
+}
+
+/* The values v holds: the elements of a list, or the root of the tree
+ * behind it, the children of a tree node or what a closure captured */
+static inline lval** lwalk_kids(lval* v, int* n) {
+    *n = 0;
+    if (lval_is_fix(v)) { return NULL; }
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->flags & LFLAG_RRB) {
+                *n = 1;
+                return &v->root;
+            }
+            *n = v->count;
+            return v->cell;
+        case LVAL_NODE:
+            *n = v->count;
+            return lrrb_kids(v);
+        case LVAL_LAMBDA:
+            *n = v->count;
+            return lval_captures(v);
+    }
+    return NULL;
+}
+
+/* Whether v holds nothing and is never copied or freed: an immediate or an
+ * atom. Walks step over these without looking any further. */
+static inline int lwalk_leaf(lval* v) {
+    return lval_is_fix(v) || (v->flags & LFLAG_ATOM);
+}
+
+/* Index of the first of the n values in kids that is not a leaf */
+static inline int lwalk_skip(lval** kids, int n) {
+    int i = 0;
+    while (i < n && lwalk_leaf(kids[i])) { i++; }
+    return i;
+}
+
+/* Queue the values v holds from the first that is not a leaf, returning
+ * whether there were any */
+static inline int lwalk_descend(lval* v) {
+    int n;
+    lval** kids = lwalk_kids(v, &n);
+    int i = lwalk_skip(kids, n);
+    if (i == n) { return 0; }
+    lwalk_push(v, kids + i, n - i);
+    return 1;
+}
+
+/* Queue the values of x to be filled in from those of v, copying across
+ * the leaves up to the first that is not one. Returns whether there was
+ * anything left to fill in. */
+static inline int lwalk_descend_from(lval* x, lval* v) {
+    int n;
+    lval** kids = lwalk_kids(x, &n);
+    lval** from = lwalk_kids(v, &n);
+    int i = 0;
+    for (; i < n && lwalk_leaf(from[i]); i++) { kids[i] = from[i]; }
+    if (i == n) { return 0; }
+    lwalk_frame* f = lwalk_push(x, kids + i, n - i);
+    f->w = v;
+    f->with = from + i;
+    return 1;
+}
+
+/* Fill in x, made by fn from v with room for the same values, with what fn
+ * makes of each of v's values, and so on down through any new values fn
+ * gives back. fn gives back either the value it was passed, to be shared,
+ * or a new one whose values are left for this to fill in.
+ *
+ * The children of the frame on top are worked through in a loop of their
+ * own until one needs a frame in turn. Going down into the last child, a
+ * frame makes way for the child's, so that a chain of lists each ending in
+ * the next takes a single frame however long it is. */
+static inline lval* lwalk_map(lval* x, lval* v, lval* (*fn)(lval*)) {
+    long bottom = lwalk.count;
+    lwalk_descend_from(x, v);
+
+    while (lwalk.count > bottom) {
+        lwalk_frame* f = &lwalk.items[lwalk.count - 1];
+        lval** kids = f->kids;
+        lval** from = f->with;
+        int n = f->n;
+        int i = f->i;
+        for (; i < n; i++) {
+            if (i + LWALK_AHEAD < n) { lprefetch(from[i + LWALK_AHEAD]); }
+            lval* k = from[i];
+            if (lwalk_leaf(k)) {
+                kids[i] = k;
+                continue;
+            }
+            lval* y = fn(k);
+            kids[i] = y;
+            if (y == k) { continue; }
+
+            f->i = i + 1;
+            if (f->i == n) { lwalk.count--; }
+            if (lwalk_descend_from(y, k)) { break; }
+            if (f->i == n) { lwalk.count++; }
+        }
+        if (i == n) { lwalk.count--; }
+    }
+    return x;
+}
+
+/* Drop one reference to v, returning whether it was the last */
+static int lval_unref(lval* v) {
+    if (lval_is_fix(v) || (v->flags & (LFLAG_REGION | LFLAG_ATOM | LFLAG_GC))) { return 0; }
+    switch (v->type) {
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+        case LVAL_NODE:
+        case LVAL_VEC:
+        case LVAL_LAMBDA:
+        case LVAL_PROTO:
+            return --v->refs == 0;
+    }
+    /* Errors, boxed numbers and builtins are never shared */
+    return 1;
+}
+
+static void lhcons_forget(lval* v);
+
+/* Give back the memory of v, whose children have already been released */
+static void lval_free(lval* v) {
+    if (v->flags & LFLAG_CONSED) { lhcons_forget(v); }
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && !(v->flags & LFLAG_RRB)) {
+        lval_cells_free(v);
+    }
+    lval_pool_release(v, lval_size(v));
+}
+
+/* Queue the children of v, whose last reference has gone, to be released
+ * before v itself is freed. A closure's code goes after what it captured. */
+static void lval_release_push(lval* v) {
+    if (v->type == LVAL_LAMBDA) {
+        lwalk_push(v, &v->proto, 1);
+        lwalk_push(NULL, lval_captures(v), v->count);
+        return;
+    }
+    if (v->type == LVAL_PROTO) {
+        lwalk_push(v, &v->consts, 1);
+        return;
+    }
+    if (!lwalk_descend(v)) { lval_free(v); }
+}
+
+/* Pop the frame on top, freeing the value it belongs to */
+static void lval_release_pop(void) {
+    lval* x = lwalk.items[--lwalk.count].v;
+    if (x) { lval_free(x); }
+}
+
+/* Drop one reference to a pool value, freeing it along with the last one.
+ * A value whose last child goes is freed before that child is looked at,
+ * the same as in lwalk_map. */
+void lval_release(lval* v) {
+    if (!lval_unref(v)) { return; }
+
+    long bottom = lwalk.count;
+    lval_release_push(v);
+    while (lwalk.count > bottom) {
+        lwalk_frame* f = &lwalk.items[lwalk.count - 1];
+        lval** kids = f->kids;
+        int n = f->n;
+        int i = f->i;
+        for (; i < n; i++) {
+            if (i + LWALK_AHEAD < n) { lprefetch(kids[i + LWALK_AHEAD]); }
+            lval* k = kids[i];
+            if (!lval_unref(k)) { continue; }
+            f->i = i + 1;
+            if (f->i == n) { lval_release_pop(); }
+            lval_release_push(k);
+            break;
+        }
+        if (i == n) { lval_release_pop(); }
+    }
+}
+
+void lval_del(lval* v) {
+    /* Immediates own no memory, and the collector decides when the rest go */
+    if (lval_is_fix(v) || gc.enabled) { return; }
+
+    /* Region values, and everything they point to, go when the region ends.
+     * Atoms live for the whole session. */
+    if (v->flags & (LFLAG_REGION | LFLAG_ATOM)) { return; }
+
+    /* Pool values are only borrowed while evaluating */
+    if (region.active) { return; }
+
+    lval_release(v);
+}
+
+lval* lval_add(lval* v, lval* x) {
+    /* Grow geometrically into the next size class only when full */
+    if (v->count == v->cap) {
+        int cap = lcells_capacity(v->cap * 2 > 0 ? v->cap * 2 : 1);
+        lval** cell = lval_cells_alloc(v, cap);
+        if (v->count) { memcpy(cell, v->cell, sizeof(lval*) * v->count); }
+        lval_cells_free(v);
+        v->cell = cell;
+        v->cap = cap;
+    }
+    v->cell[v->count++] = x;
+    lval_unhash(v);
+    return v;
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    return errno != ERANGE ? lval_num(x) : lval_err("Invalid number.");
+}
+
+/* If Symbol or Number, convert and return, otherwise NULL */
+static lval* lval_read_atom(mpc_ast_t* t) {
+    if (strstr(t->tag, "number")) { return lval_read_num(t); }
+    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+    return NULL;
+}
+
+/* If root (>) or sexpr then create an empty list */
+static lval* lval_read_list(mpc_ast_t* t) {
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+    return x;
+}
+
+/* Whether child t of a list is punctuation rather than an expression */
+static int lval_read_skip(mpc_ast_t* t) {
+    if (strcmp(t->contents, "(") == 0) { return 1; }
+    if (strcmp(t->contents, ")") == 0) { return 1; }
+    if (strcmp(t->contents, "{") == 0) { return 1; }
+    if (strcmp(t->contents, "}") == 0) { return 1; }
+    if (strcmp(t->tag, "regex") == 0) { return 1; }
+    return 0;
+}
+
+/* A list being read, of which i children of its tree have been looked at */
+typedef struct {
+    mpc_ast_t* t;
+    lval* x;
+    int i;
+} lread_frame;
+
+static struct {
+    lread_frame* items;
+    long count;
+    long cap;
+} lread_stack;
+
+static void lread_push(mpc_ast_t* t) {
+    lread_stack.items = lgrow(lread_stack.items, lread_stack.count, &lread_stack.cap, sizeof(lread_frame));
+    lread_stack.items[lread_stack.count++] = (lread_frame){ t, lval_read_list(t), 0 };
+}
+
+/* Lists still being filled in are kept on a stack rather than in calls, so
+ * the parser's nesting is not limited by the C stack here either */
+lval* lval_read(mpc_ast_t* t) {
+    lval* x = lval_read_atom(t);
+    if (x) { return x; }
+
+    long bottom = lread_stack.count;
+    lread_push(t);
+    while (1) {
+        lread_frame* f = &lread_stack.items[lread_stack.count - 1];
+
+        /* Fill in this list with any valid expression contained within */
+        if (f->i < f->t->children_num) {
+            mpc_ast_t* c = f->t->children[f->i++];
+            if (lval_read_skip(c)) { continue; }
+            if ((x = lval_read_atom(c))) {
+                f->x = lval_add(f->x, x);
+            } else {
+                lread_push(c);
+            }
+            continue;
+        }
+
+        x = f->x;
+        if (--lread_stack.count == bottom) { return x; }
+        f = &lread_stack.items[lread_stack.count - 1];
+        f->x = lval_add(f->x, x);
+    }
+}
+
+/* Print v if it holds no other values */
+static void lval_print_atom(lval* v) {
+    if (lval_is_fix(v)) {
+        printf("%li", lfix_val(v));
+        return;
+    }
+
+    switch(v->type) {
+        case LVAL_NUM:
+            printf("%li", v->num);
+            break;
+
+        case LVAL_ERR:
+            printf("Error: %s", v->str);
+            break;
+
+        case LVAL_SYM:
+            printf("%s", v->str);
+            break;
+
+        case LVAL_VEC:
+            putchar('[');
+            for (int i = 0; i < v->count; i++) {
+                printf(i ? " %li" : "%li", lval_vec_items(v)[i]);
+            }
+            putchar(']');
+            break;
+        case LVAL_FUN:
+            printf("<function>");
+            break;
+    }
+}
+
+/* Print the start of v and queue the values it holds, or all of v if it
+ * holds none. A closure prints as the lambda it was made from. The
+ * elements of a list backed by a tree are at the bottom of the tree, and
+ * first is set until the first of them has been printed. */
+static void lval_print_begin(lval* v, int* first) {
+    if (lval_is_fix(v)) {
+        lval_print_atom(v);
+        return;
+    }
+
+    switch(v->type) {
+        case LVAL_SEXPR:
+            putchar('(');
+            lwalk_push(v, v->cell, v->count);
+            break;
+
+        case LVAL_QEXPR:
+            putchar('{');
+            if (v->flags & LFLAG_RRB) {
+                *first = 1;
+                lwalk_push(v, &v->root, 1);
+                break;
+            }
+            lwalk_push(v, v->cell, v->count);
+            break;
+        case LVAL_NODE:
+            lwalk_push(v, lrrb_kids(v), v->count);
+            break;
+        case LVAL_LAMBDA:
+            printf("(\\ ");
+            lwalk_push(v, v->proto->consts->cell, 2);
+            break;
+        default:
+            lval_print_atom(v);
+    }
+}
+
+/* Print an lval */
+void lval_print(lval* v) {
+    long bottom = lwalk.count;
+    int first = 1;
+    lval_print_begin(v, &first);
+
+    while (lwalk.count > bottom) {
+        lwalk_frame* f = &lwalk.items[lwalk.count - 1];
+        lval* x = f->v;
+        lval** k = lwalk_next();
+        if (!k) {
+            if (x->type == LVAL_SEXPR || x->type == LVAL_LAMBDA) { putchar(')'); }
+            if (x->type == LVAL_QEXPR) { putchar('}'); }
+            lwalk.count--;
+            continue;
+        }
+
+        if (x->type == LVAL_NODE) {
+            if (x->height == 0) {
+                if (!first) { putchar(' '); }
+                first = 0;
+            }
+        } else if (!(x->flags & LFLAG_RRB) && k != f->kids) {
+            putchar(' ');
+        }
+        lval_print_begin(*k, &first);
+    }
+}
+
+/* Print an lval followed by a newline */
+void lval_println(lval* v) {
+    lval_print(v);
+    putchar('\n');
+}
+
+/* Whether a and b can be equal going by them alone, before any values
+ * they hold are compared */
+static int lval_eq_one(lval* a, lval* b) {
+    if (lval_is_fix(a) || lval_is_fix(b)) {
+        return lval_type(a) == LVAL_NUM && lval_type(b) == LVAL_NUM && lval_numval(a) == lval_numval(b);
+    }
+    if (a->type != b->type) { return 0; }
+
+    switch (a->type) {
+        case LVAL_NUM: return a->num == b->num;
+        case LVAL_ERR: return strcmp(a->str, b->str) == 0;
+        case LVAL_FUN: return a->fun == b->fun;
+        case LVAL_VEC:
+            return a->count == b->count
+                && memcmp(lval_vec_items(a), lval_vec_items(b), sizeof(long) * a->count) == 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            /* Lists whose hashes are known and differ cannot be equal */
+            if (a->count != b->count) { return 0; }
+            unsigned long ha = *lval_hash_cache(a);
+            unsigned long hb = *lval_hash_cache(b);
+            return !ha || !hb || ha == hb;
+        case LVAL_LAMBDA:
+            return a->proto == b->proto;
+    }
+    /* Symbols are interned, so different symbols have different names */
+    return 0;
+}
+
+/* The values list or closure v holds, laid out flat for comparing */
+static lval** lval_eq_kids(lval* v) {
+    if (v->flags & LFLAG_RRB) {
+        lval** kids = malloc(sizeof(lval*) * v->count);
+        lrrb_flatten(v->root, kids);
+        return kids;
+    }
+    return v->type == LVAL_LAMBDA ? lval_captures(v) : v->cell;
+}
+
+/* Start comparing the values a and b hold, which there are the same
+ * number of, returning whether there were any */
+static int lval_eq_push(lval* a, lval* b) {
+    if (lval_is_fix(a) || !a->count) { return 0; }
+    if (a->type != LVAL_SEXPR && a->type != LVAL_QEXPR && a->type != LVAL_LAMBDA) { return 0; }
+
+    lwalk_frame* f = lwalk_push(a, lval_eq_kids(a), a->count);
+    f->w = b;
+    f->with = lval_eq_kids(b);
+    for (int i = 0; i < f->n && i < LWALK_AHEAD; i++) { lprefetch(f->with[i]); }
+    return 1;
+}
+
+static void lval_eq_pop(void) {
+    lwalk_frame* f = &lwalk.items[--lwalk.count];
+    if (f->v->flags & LFLAG_RRB) { free(f->kids); }
+    if (f->w->flags & LFLAG_RRB) { free(f->with); }
+}
+
+/* Children compared at once while two lists' cells are bitwise the same */
+#define LEQ_RUN 8
+
+/* Whether a and b are the same value: equal numbers, the same symbol or
+ * builtin, errors with the same message, equal vectors, lists of equal
+ * elements however they are stored, or closures over the same lambda that
+ * captured equal values. Walks both the way lwalk_map walks one.
+ *
+ * Immediates are equal exactly when their bits are, and so are children
+ * both lists share, so the children of two lists are first compared with
+ * memcmp a block at a time, which sees through lists of numbers without
+ * looking at them one by one, and then one by one from the first block
+ * that differs. */
+int lval_eq(lval* a, lval* b) {
+    if (a == b) { return 1; }
+    if (!lval_eq_one(a, b)) { return 0; }
+
+    long bottom = lwalk.count;
+    int eq = 1;
+    lval_eq_push(a, b);
+    while (eq && lwalk.count > bottom) {
+        lwalk_frame* f = &lwalk.items[lwalk.count - 1];
+        lval** kids = f->kids;
+        lval** with = f->with;
+        int n = f->n;
+        int i = f->i;
+        if (i == 0) {
+            while (i + LEQ_RUN <= n && memcmp(kids + i, with + i, sizeof(lval*) * LEQ_RUN) == 0) { i += LEQ_RUN; }
+        }
+        for (; i < n; i++) {
+            if (i + LWALK_AHEAD < n) {
+                lprefetch(kids[i + LWALK_AHEAD]);
+                lprefetch(with[i + LWALK_AHEAD]);
+            }
+            lval* x = kids[i];
+            lval* y = with[i];
+            if (x == y) { continue; }
+            if (!lval_eq_one(x, y)) {
+                eq = 0;
+                break;
+            }
+
+            f->i = i + 1;
+            if (f->i == n) {
+                lval_eq_pop();
+                lval_eq_push(x, y);
+                break;
+            }
+            if (lval_eq_push(x, y)) { break; }
+        }
+        if (i == n) { lval_eq_pop(); }
+    }
+    while (lwalk.count > bottom) { lval_eq_pop(); }
+    return eq;
+}
+
+/* Structural hashing
+ *
+ * lval_hash gives a 64 bit hash of a value's contents that agrees with
+ * lval_eq: values it finds equal hash the same. Numbers hash by value,
+ * symbols by name, vectors by their numbers, closures by the lambda they
+ * were made from and lists by their elements in order, whether they are
+ * S or Q-Expressions and however their cells are stored.
+ *
+ * A list keeps its hash once worked out, so hashing it again, or anything
+ * it is part of, costs nothing. Lists are only changed in place while
+ * nothing else can see them (see lval_own), and every change goes through
+ * lval_add, lval_pop or the evaluator, which clear the hash. Copies keep the
+ * hash of what they were copied from. The hashes that lval_eq finds
+ * already worked out let it tell most unequal lists apart without looking
+ * at their elements.
+ */
+
+static inline unsigned long lhash_mix(unsigned long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline int lval_is_list(lval* v) {
+    return !lval_is_fix(v) && (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
+}
+
+/* Hash of anything but a list, or of a list whose hash is known */
+static unsigned long lval_hash_one(lval* v) {
+    if (lval_is_fix(v)) { return lhash_mix((unsigned long)lfix_val(v)); }
+
+    switch (v->type) {
+        case LVAL_NUM: return lhash_mix((unsigned long)v->num);
+        case LVAL_SYM: return v->hash;
+        case LVAL_ERR: return lintern_hash(v->str);
+        case LVAL_FUN: return lhash_mix((unsigned long)(uintptr_t)v->fun);
+        case LVAL_LAMBDA: return lhash_mix((unsigned long)(uintptr_t)v->proto);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return *lval_hash_cache(v);
+        case LVAL_VEC: {
+            unsigned long h = lhash_mix(v->count);
+            long* items = lval_vec_items(v);
+            for (int i = 0; i < v->count; i++) { h = lhash_mix(h ^ (unsigned long)items[i]); }
+            return h;
+        }
+    }
+    return 0;
+}
+
+/* Hash of a list of the n values in kids, whose own hashes are all known.
+ * Never 0, which marks a hash not yet worked out. */
+static unsigned long lval_hash_cells(lval** kids, int n) {
+    unsigned long h = lhash_mix(n);
+    for (int i = 0; i < n; i++) { h = lhash_mix(h ^ lval_hash_one(kids[i])); }
+    return h ? h : 1;
+}
+
+/* Start hashing the elements of list v, flattening it first if it is
+ * backed by a tree */
+static void lval_hash_push(lval* v) {
+    lwalk_push(v, lval_eq_kids(v), v->count);
+}
+
+static void lval_hash_pop(void) {
+    lwalk_frame* f = &lwalk.items[--lwalk.count];
+    if (f->v->flags & LFLAG_RRB) { free(f->kids); }
+}
+
+/* Hash of v, working out those of the lists under it that are not yet
+ * known from the innermost out */
+unsigned long lval_hash(lval* v) {
+    if (!lval_is_list(v) || *lval_hash_cache(v)) { return lval_hash_one(v); }
+
+    long bottom = lwalk.count;
+    lval_hash_push(v);
+    while (lwalk.count > bottom) {
+        lwalk_frame* f = &lwalk.items[lwalk.count - 1];
+        while (f->i < f->n && !(lval_is_list(f->kids[f->i]) && !*lval_hash_cache(f->kids[f->i]))) { f->i++; }
+        if (f->i < f->n) {
+            lval_hash_push(f->kids[f->i]);
+            continue;
+        }
+        *lval_hash_cache(f->v) = lval_hash_cells(f->kids, f->n);
+        lval_hash_pop();
+    }
+    return *lval_hash_cache(v);
+}
+
+/* Hash-consing
+ *
+ * Run with --hash-cons to keep a single copy of each distinct list that
+ * def binds. Once a value is promoted for its binding, the lists in it are
+ * looked up from the innermost out in a table of canonical lists, by hash
+ * and then with lval_eq. A list already there is shared in place of the
+ * new one, which is let go, and one that is not takes its place in the
+ * table. The same fragment defined under many names then takes up memory
+ * once, and copies of it are equal by pointer, which lval_eq and == see
+ * straight away. Symbols are interned already (see lintern).
+ *
+ * The table is weak: it holds no references of its own, and a list leaves
+ * it when lval_free gives it back. Only pool lists with cells of their own
+ * are canonical, as pool values never change in place. Lists backed by
+ * trees are left alone, and so is everything under the collector, where
+ * bindings hold collected values rather than promoted ones.
+ */
+
+static int lhcons_enabled;
+
+/* Marks a slot whose list has gone, so that lookups carry on past it */
+static char lhcons_gone;
+#define LHCONS_GONE ((lval*)&lhcons_gone)
+
+static struct {
+    lval** items;
+    long size;
+    long count;
+    /* Slots holding a list or marking one that has gone */
+    long used;
+    /* Lists let go in favour of one already in the table */
+    long shared;
+} lhcons;
+
+/* Whether v is a list that is not yet canonical but can be */
+static inline int lhcons_candidate(lval* v) {
+    return lval_is_list(v)
+        && !(v->flags & (LFLAG_REGION | LFLAG_GC | LFLAG_VIEW | LFLAG_RRB | LFLAG_CONSED));
+}
+
+static lval* lhcons_find(lval* v, unsigned long hash) {
+    if (!lhcons.size) { return NULL; }
+    unsigned long mask = lhcons.size - 1;
+    for (unsigned long i = hash & mask; lhcons.items[i]; i = (i + 1) & mask) {
+        lval* c = lhcons.items[i];
+        if (c != LHCONS_GONE && *lval_hash_cache(c) == hash && lval_eq(c, v)) { return c; }
+    }
+    return NULL;
+}
+
+static void lhcons_insert(lval* v) {
+    unsigned long mask = lhcons.size - 1;
+    unsigned long i = *lval_hash_cache(v) & mask;
+    while (lhcons.items[i] && lhcons.items[i] != LHCONS_GONE) { i = (i + 1) & mask; }
+    if (!lhcons.items[i]) { lhcons.used++; }
+    lhcons.items[i] = v;
+    lhcons.count++;
+}
+
+/* Rebuild the table without the slots of lists that have gone, doubling
+ * it as long as it would be more than a quarter full */
+static void lhcons_rebuild(void) {
+    long old_size = lhcons.size;
+    lval** old = lhcons.items;
+
+    lhcons.size = old_size ? old_size : 256;
+    while ((lhcons.count + 1) * 4 > lhcons.size) { lhcons.size *= 2; }
+    lhcons.items = calloc(lhcons.size, sizeof(lval*));
+    lhcons.count = 0;
+    lhcons.used = 0;
+    for (long i = 0; i < old_size; i++) {
+        if (old[i] && old[i] != LHCONS_GONE) { lhcons_insert(old[i]); }
+    }
+    free(old);
+}
+
+static void lhcons_forget(lval* v) {
+    unsigned long mask = lhcons.size - 1;
+    unsigned long i = *lval_hash_cache(v) & mask;
+    while (lhcons.items[i] != v) { i = (i + 1) & mask; }
+    lhcons.items[i] = LHCONS_GONE;
+    lhcons.count--;
+}
+
+/* The canonical list equal to v, all of whose lists are canonical already:
+ * the one in the table, taking a reference to it and letting go of v, or
+ * v itself, which goes in the table */
+static lval* lhcons_intern(lval* v) {
+    lval* c = lhcons_find(v, lval_hash(v));
+    if (c) {
+        lhcons.shared++;
+        lval_share(c);
+        lregion_defer_release(v);
+        return c;
+    }
+
+    /* Keep the table at most half full, counting the slots of lists gone */
+    if ((lhcons.used + 1) * 2 > lhcons.size) { lhcons_rebuild(); }
+    lhcons_insert(v);
+    v->flags |= LFLAG_CONSED;
+    return v;
+}
+
+/* Pool value v with the lists under it, and then v itself, replaced by
+ * their canonical lists, working from the innermost out */
+lval* lhcons_value(lval* v) {
+    if (!lhcons_enabled || !lhcons_candidate(v)) { return v; }
+
+    long bottom = lwalk.count;
+    lwalk_push(v, v->cell, v->count);
+    lval* done = NULL;
+    while (lwalk.count > bottom) {
+        lwalk_frame* f = &lwalk.items[lwalk.count - 1];
+        if (done) {
+            f->kids[f->i++] = done;
+            done = NULL;
+        }
+        while (f->i < f->n && !lhcons_candidate(f->kids[f->i])) { f->i++; }
+        if (f->i < f->n) {
+            lval* k = f->kids[f->i];
+            lwalk_push(k, k->cell, k->count);
+            continue;
+        }
+
+        lval* x = f->v;
+        lwalk.count--;
+        done = lhcons_intern(x);
+    }
+    return done;
+}
+
+void lhcons_stats_print(void) {
+    if (!lhcons_enabled) { return; }
+    printf("hash-cons lists: %li shared: %li\n", lhcons.count, lhcons.shared);
+}
+
+lval* lval_pop(lval* v, int index) {
+    // get the item at index
+    lval* to_pop = v->cell[index];
+
+    /* Shift memory to cover up the spot we're taking */
+    memmove(&v->cell[index], &v->cell[index+1], sizeof(lval*) * (v->count-index-1));
+
+    /* The array keeps its capacity so later adds can reuse the space */
+    v->count--;
+    lval_unhash(v);
+    return to_pop;
+}
+
+lval* lval_take(lval* v, int index) {
+    lval* x = lval_pop(v, index);
+    lval_del(v);
+    return x;
+}
+
+/* A copy of v's header and payload with room for its children, which
+ * lval_copy fills in, or v itself where it is shared rather than copied */
+static lval* lval_copy_one(lval* v) {
+    /* Immediates are values, not references, so there is nothing to copy */
+    if (lval_is_fix(v)) { return v; }
+
+    /* Symbols are shared atoms; error messages are copied along with the header */
+    if (v->type == LVAL_SYM) { return v; }
+    if (v->type == LVAL_ERR) { return lval_str(LVAL_ERR, v->str); }
+
+    /* Vectors hold nothing but numbers, so one copy of the block does */
+    if (v->type == LVAL_VEC) {
+        lval* x = lval_vec(v->count);
+        memcpy(lval_vec_items(x), lval_vec_items(v), sizeof(long) * v->count);
+        return x;
+    }
+
+    /* Trees are copied node by node */
+    if (v->type == LVAL_NODE) { return lrrb_node(v->height, lrrb_kids(v), v->count, NULL, 0); }
+
+    /* Closures copy what they captured and share their code, which never
+     * changes */
+    if (v->type == LVAL_LAMBDA) { return lval_lambda(v->proto, v->count); }
+    if (v->type == LVAL_PROTO) { return lval_share(v); }
+
+    lval* x = lval_alloc(v->type, lval_size(v));
+
+    switch (v->type) {
+        /* Copy functions and numbers directly */
+        case LVAL_FUN: x->fun = v->fun; break;
+        case LVAL_NUM: x->num = v->num; break;
+
+        /* Lists get cells of their own, or a tree */
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->count = v->count;
+            x->refs = 1;
+            *lval_hash_cache(x) = *lval_hash_cache(v);
+            if (v->flags & LFLAG_RRB) {
+                x->flags |= LFLAG_RRB;
+                break;
+            }
+            lval_cells_reserve(x, x->count);
+            break;
+    }
+
+    return x;
+}
+
+lval* lval_copy(lval* v) {
+    lval* x = lval_copy_one(v);
+    return x == v ? x : lwalk_map(x, v, lval_copy_one);
+}
+
+/* Take a new reference to a pool value. Lists, vectors and lambdas are
+ * shared, the small scalar lvals are cheaper to copy than to count. */
+lval* lval_share(lval* v) {
+    if (lval_is_fix(v) || (v->flags & LFLAG_ATOM)) { return v; }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR || v->type == LVAL_VEC || v->type == LVAL_NODE
+        || v->type == LVAL_LAMBDA || v->type == LVAL_PROTO) {
+        v->refs++;
+        return v;
+    }
+    return lval_copy(v);
+}
+
+/* v in pool memory with room for its children, which lval_promote fills
+ * in, or v itself with a new reference if it is already there */
+static lval* lval_promote_one(lval* v) {
+    int active = region.active;
+    region.active = 0;
+    lval* x;
+    if (lval_is_fix(v) || !(v->flags & LFLAG_REGION)) {
+        x = lval_share(v);
+    } else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        /* Views get cells of their own */
+        x = lval_alloc(v->type, LVAL_LIST_SIZE);
+        x->count = v->count;
+        x->refs = 1;
+        *lval_hash_cache(x) = *lval_hash_cache(v);
+        if (v->flags & LFLAG_RRB) {
+            x->flags |= LFLAG_RRB;
+        } else {
+            lval_cells_reserve(x, x->count);
+        }
+    } else {
+        /* Closures get their code from outside the region, which is shared */
+        x = lval_copy_one(v);
+    }
+    region.active = active;
+    return x;
+}
+
+/* Give v a long lived owned reference in pool memory. Region values are
+ * copied out, down to the first pool values they borrowed, which are shared
+ * rather than copied again. */
+lval* lval_promote(lval* v) {
+    lval* x = lval_promote_one(v);
+    return x == v ? x : lwalk_map(x, v, lval_promote_one);
+}
+
+/* A version of list v that can be changed in place. Region lists belong to
+ * the expression being evaluated and are returned as they are, as are
+ * collected lists, unless they are shared: bound anywhere or passed to a
+ * lambda. Pool lists, shared lists, views and lists backed by trees are
+ * copied first; the copy is shallow and its children stay borrowed until
+ * they are changed in turn. */
+lval* lval_own(lval* v) {
+    if (!(v->flags & (LFLAG_VIEW | LFLAG_RRB | LFLAG_SHARED))) {
+        if (v->flags & (LFLAG_REGION | LFLAG_GC)) { return v; }
+    }
+
+    lval* x = lval_list(v->type, v->count);
+    x->count = v->count;
+    *lval_hash_cache(x) = *lval_hash_cache(v);
+    if (v->flags & LFLAG_RRB) {
+        lrrb_flatten(v->root, x->cell);
+    } else if (x->count) {
+        memcpy(x->cell, v->cell, sizeof(lval*) * x->count);
+    }
+    return x;
+}
+
+/* v, or if it is backed by a tree a flat copy, for reading its cells */
+lval* lval_flat(lval* v) {
+    return (v->flags & LFLAG_RRB) ? lval_own(v) : v;
+}
+
+lval* lval_join(lval* x, lval* y) {
+    /* Add everything in y to x. The children move across if y is ours and
+     * stay borrowed if y is shared, so y itself is never changed. */
+    for (int i = 0; i < y->count; i++) {
+        x = lval_add(x, y->cell[i]);
+    }
+    return x;
+}
+
+lval* lval_eval(lenv* e, lval* v);
+
+/* Tail calls
+ *
+ * Builtins whose value is that of another expression, eval and if, leave
+ * it to their caller to evaluate. They hand it over with lval_tail, which
+ * returns LTAIL in place of a value, and the evaluator that called them
+ * carries on with the expression as if it had been there all along: the
+ * tree walker loops in lval_eval, and the VM runs it in the same lvm_exec
+ * when the call was in tail position (see LOP_TAILCALL). Either way a
+ * chain of them takes no more C stack than one.
+ *
+ * Lambdas are not builtins and make their tail calls in the VM, which
+ * reuses the caller's frame for them.
+ */
+
+static lval ltail_mark;
+#define LTAIL (&ltail_mark)
+
+static lval* ltail_expr;
+
+/* Have the caller evaluate S-Expression v in place of the builtin */
+lval* lval_tail(lval* v) {
+    ltail_expr = v;
+    return LTAIL;
+}
+
+/* An empty S-Expression that is never changed or freed, for code that has
+ * to give () without allocating it */
+static lval lnil = { .type = LVAL_SEXPR, .flags = LFLAG_ATOM };
+
+lval* llambda_call(lenv* e, long base, int n);
+
+/* Evaluation depth
+ *
+ * Neither evaluator recurses in C as expressions nest or calls are made.
+ * The tree walker keeps the S-Expressions it is part way through on a stack
+ * of its own, and the VM keeps the calls to lambdas it has to return to on
+ * another (see lvm_frame), so how deep expressions and calls go is up to
+ * leval_max_depth rather than the size of the C stack. Going deeper gives an
+ * error in place of the expression or call that would have. The limit is
+ * LEVAL_MAX_DEPTH unless set with --max-depth. Reading and compiling keep
+ * their own stacks as well, and are only limited by memory.
+ */
+
+#ifndef LEVAL_MAX_DEPTH
+#define LEVAL_MAX_DEPTH 1000000
+#endif
+
+static long leval_max_depth = LEVAL_MAX_DEPTH;
+
+void lgc_maybe_collect(void);
+
+static lval* leval_too_deep(void) {
+    return lval_err("Maximum evaluation depth of %li exceeded!", leval_max_depth);
+}
+
+/* An S-Expression the tree walker is evaluating, i of whose children have
+ * been evaluated in place */
+typedef struct {
+    lval* v;
+    int i;
+} leval_frame;
+
+static struct {
+    leval_frame* items;
+    long count;
+    long cap;
+} leval_stack;
+
+/* Start evaluating S-Expression v, giving NULL, or an error if the stack is
+ * full */
+static lval* leval_push(lval* v) {
+    if (leval_stack.count >= leval_max_depth) { return leval_too_deep(); }
+    leval_stack.items = lgrow(leval_stack.items, leval_stack.count, &leval_stack.cap, sizeof(leval_frame));
+
+    /* Keep v alive for as long as its children are being evaluated, which
+     * replaces them one by one */
+    v = lval_own(v);
+    lval_unhash(v);
+    leval_stack.items[leval_stack.count++] = (leval_frame){ v, 0 };
+    if (gc.enabled) {
+        lgc_push_root(v);
+        lgc_maybe_collect();
+    }
+    return NULL;
+}
+
+static void leval_pop(void) {
+    leval_stack.count--;
+    if (gc.enabled) { lgc_pop_root(); }
+}
+
+/* Apply S-Expression v, whose children have been evaluated */
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    /* Error checking */
+    for (int i = 0; i < v->count; i++) {
+        if (lval_type(v->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
+    }
+
+    /* Check for empty expression */
+    if (v->count == 0) { return v; }
+
+    /* Check for single expression */
+    if (v-> count == 1) { return lval_take(v, 0); }
+
+    /* Lambdas take their arguments on the VM's stack, as their bodies are
+     * always run as bytecode */
+    lval* f = v->cell[0];
+    if (lval_type(f) == LVAL_LAMBDA) {
+        long base = lvm_stack.count;
+        for (int i = 0; i < v->count; i++) { lstack_push(&lvm_stack, v->cell[i]); }
+        lval* x = llambda_call(e, base, v->count - 1);
+        lvm_stack.count = base;
+        return x;
+    }
+
+    /* Ensure first element is a function */
+    if (lval_type(f) != LVAL_FUN) {
+        /* We don't have a function so we need to cleanup and return an error. */
+        lval_del(v);
+        return lval_err("S-expression does not start with a function!");
+    }
+
+    /* Call builtin with the arguments that follow it */
+    return f->fun(e, v->cell + 1, v->count - 1);
+}
+
+lval* lenv_get(lenv* e, lval* k);
+
+/* The value of anything but an S-Expression */
+static lval* lval_eval_atom(lenv* e, lval* v) {
+    /* Immediates evaluate to themselves */
+    if (lval_is_fix(v)) { return v; }
+
+    if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+
+    /* all other types remain unchanged */
+    return v;
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    if (lval_is_fix(v) || v->type != LVAL_SEXPR) { return lval_eval_atom(e, v); }
+
+    /* S-Expressions are changed in place, each child replaced by its value
+     * before the whole is applied */
+    long bottom = leval_stack.count;
+    lval* x = leval_push(v);
+    if (x) { return x; }
+    while (1) {
+        leval_frame* f = &leval_stack.items[leval_stack.count - 1];
+        if (f->i < f->v->count) {
+            lval* c = f->v->cell[f->i];
+            if (lval_is_fix(c) || c->type != LVAL_SEXPR) {
+                f->v->cell[f->i++] = lval_eval_atom(e, c);
+            } else if ((x = leval_push(c))) {
+                f->v->cell[f->i++] = x;
+            }
+            continue;
+        }
+
+        x = lval_eval_sexpr(e, f->v);
+        leval_pop();
+
+        /* Evaluate the expression a builtin left in its place */
+        if (x == LTAIL) {
+            if ((x = leval_push(ltail_expr)) == NULL) { continue; }
+        }
+
+        if (leval_stack.count == bottom) { return x; }
+        f = &leval_stack.items[leval_stack.count - 1];
+        f->v->cell[f->i++] = x;
+    }
+}
+
+lval* lvm_eval(lenv* e, lval* v);
+
+/* There are two evaluators. The tree walker runs top level expressions,
+ * and the bytecode VM is the backend for lambda bodies, which are compiled
+ * once and run many times. A top level expression only runs once, so
+ * compiling it costs more than the VM saves running it: on --bench the
+ * tree walker runs the arith and lambda cases at 36 and 30 Mcalls/s, where
+ * compiling and then running them comes to 19 and 26. --vm compiles top
+ * level expressions too, which is mostly of use for measuring the VM. */
+static int lvm_top;
+
+lval* leval(lenv* e, lval* v) {
+    return lvm_top ? lvm_eval(e, v) : lval_eval(e, v);
+}
+
+lval* builtin_tail(lenv* e, lval** a, int n) {
+    /* sanity checks */
+    LASSERT((n == 1), "Function 'tail' passed too many arguments!"); 
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR), "Function 'tail' passed incorrect type!");
+
+    LASSERT((a[0]->count != 0), "Function 'tail' passed '{}'!");
+
+    if (a[0]->flags & LFLAG_RRB) { return lval_rrb(lrrb_slice(a[0]->root, 1, a[0]->count)); }
+    return lval_view(a[0], 1, a[0]->count - 1);
+}
+
+lval* builtin_list(lenv* e, lval** a, int n) {
+    lval* x = lval_qexpr();
+    for (int i = 0; i < n; i++) { x = lval_add(x, a[i]); }
+    return x;
+}
+
+lval* builtin_eval(lenv* e, lval** a, int n) {
+    LASSERT((n == 1), "Function 'eval' passed too many arguments!"); 
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR), "Function 'eval' passed incorrect type!");
+
+    lval* x = lval_own(a[0]);
+    x->type = LVAL_SEXPR;
+    return lval_tail(x);
+}
+
+lval* builtin_if(lenv* e, lval** a, int n) {
+    LASSERT((n == 3), "Function 'if' passed incorrect number of arguments!");
+
+    LASSERT((lval_type(a[0]) == LVAL_NUM), "Function 'if' passed incorrect type!");
+
+    LASSERT((lval_type(a[1]) == LVAL_QEXPR && lval_type(a[2]) == LVAL_QEXPR),
+        "Function 'if' passed incorrect type!");
+
+    lval* x = lval_own(a[lval_numval(a[0]) ? 1 : 2]);
+    x->type = LVAL_SEXPR;
+    return lval_tail(x);
+}
+
+lval* builtin_join(lenv* e, lval** a, int n) {
+    for (int i = 0; i < n; i++) {
+        LASSERT((lval_type(a[i]) == LVAL_QEXPR), "Function 'join' passed incorrect type!");
+    }
+
+    /* Long results are joined as trees */
+    if (lrrb_enabled) {
+        long total = 0;
+        for (int i = 0; i < n; i++) { total += a[i]->count; }
+        if (total > LRRB_BRANCH) {
+            lval* root = NULL;
+            for (int i = 0; i < n; i++) {
+                if (a[i]->count == 0) { continue; }
+                root = root ? lrrb_concat(root, lrrb_of(a[i])) : lrrb_of(a[i]);
+            }
+            return lval_rrb(root);
+        }
+    }
+
+    /* Take the first q-exp. All other q-exps will have each of their elements
+     * added to it. */
+    lval* x = lval_own(a[0]);
+    for (int i = 1; i < n; i++) {
+        x = lval_join(x, a[i]);
+    }
+    return x;
+}
+
+/* Arithmetic
+ *
+ * Every numeric builtin is a kernel folding its arguments left to right in
+ * a single pass over the argument array. builtin_op checks the types once
+ * before handing the arguments over, so a kernel can read them with
+ * lval_numval and only has to worry about the arithmetic. Results that do
+ * not fit in a long are errors rather than wrapping around. Sums, products
+ * and differences are exact: they only fail if the final result does not
+ * fit, not if some partial result on the way to it does not.
+ */
+
+typedef lval*(*lkernel)(lval**, int);
+
+lval* builtin_op(lenv* e, lval** a, int n, lkernel k) {
+
+    /* Make sure all arguments are numbers */
+    for (int i = 0; i < n; i++) {
+        if (lval_type(a[i]) != LVAL_NUM) {
+            return lval_err("Cannot operate on non-numbers!");
+        }
+    }
+    return k(a, n);
+}
+
+/* Checked arithmetic, returning nonzero if the result overflowed. The
+ * result is stored either way, wrapped around if need be. */
+#if defined(__GNUC__) || defined(__clang__)
+#define ladd_overflow(x, y, r) __builtin_add_overflow(x, y, r)
+#define lsub_overflow(x, y, r) __builtin_sub_overflow(x, y, r)
+#define lmul_overflow(x, y, r) __builtin_mul_overflow(x, y, r)
+#else
+static int ladd_overflow(long x, long y, long* r) {
+    *r = (long)((unsigned long)x + (unsigned long)y);
+    return (y > 0 && x > LONG_MAX - y) || (y < 0 && x < LONG_MIN - y);
+}
+
+static int lsub_overflow(long x, long y, long* r) {
+    *r = (long)((unsigned long)x - (unsigned long)y);
+    return (y < 0 && x > LONG_MAX + y) || (y > 0 && x < LONG_MIN + y);
+}
+
+static int lmul_overflow(long x, long y, long* r) {
+    *r = (long)((unsigned long)x * (unsigned long)y);
+    return x > 0 ? (y > 0 ? x > LONG_MAX / y : y < LONG_MIN / x)
+                 : (y > 0 ? x < LONG_MIN / y : x != 0 && y < LONG_MAX / x);
+}
+#endif
+
+static lval* lnum_overflow(void) {
+    return lval_err("Integer overflow!");
+}
+
+/* Vectorised reductions
+ *
+ * Sums, minimums and maximums over many arguments are worked out several
+ * arguments at a time with SSE4.2 or AVX2, whichever the CPU has, picked by
+ * lsimd_init from what CPUID reports. Both work straight on the argument
+ * array, as long as every argument is an immediate: an immediate is 2x + 1,
+ * so clearing the tag bit gives 2x to add up, and immediates order the same
+ * way as the numbers they hold, so they can be compared as they are.
+ *
+ * A vector reduction gives up, returning 0, if it meets a boxed number or if
+ * a lane overflows, and the scalar kernel then does the whole job. The
+ * scalar kernels only fail when the exact result does not fit, so taking
+ * the arguments in a different order never changes the answer.
+ *
+ * Build with -DLSIMD_DISABLE to only use the scalar kernels.
+ */
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__) && !defined(LSIMD_DISABLE)
+#define LSIMD
+#include <immintrin.h>
+#define LSIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/* Fewest arguments worth a vector reduction */
+#define LSIMD_MIN 16
+
+typedef int (*lsimd_sum_fn)(lval** a, int n, long* out);
+typedef int (*lsimd_cmp_fn)(lval** a, int n, int max, long* out);
+typedef int (*lsimd_zero_fn)(lval** a, int n);
+
+static struct {
+    const char* name;
+    lsimd_sum_fn sum;
+    lsimd_cmp_fn minmax;
+    lsimd_zero_fn has_zero;
+} lsimd = { "scalar", NULL, NULL, NULL };
+
+#ifdef LSIMD
+
+/* Add up the halves of lanes holding sums of 2x, and the arguments past the
+ * last full vector */
+static int lsimd_sum_finish(long* lanes, int count, lval** a, int i, int n, long* out) {
+    long x = 0;
+    for (int k = 0; k < count; k++) {
+        if (ladd_overflow(x, lanes[k] / 2, &x)) { return 0; }
+    }
+    for (; i < n; i++) {
+        if (!lval_is_fix(a[i]) || ladd_overflow(x, lfix_val(a[i]), &x)) { return 0; }
+    }
+    *out = x;
+    return 1;
+}
+
+/* The smallest or largest of lanes holding immediates and the arguments
+ * past the last full vector */
+static int lsimd_minmax_finish(long* lanes, int count, lval** a, int i, int n, int max, long* out) {
+    long m = lanes[0];
+    for (int k = 1; k < count; k++) {
+        if (max ? lanes[k] > m : lanes[k] < m) { m = lanes[k]; }
+    }
+    for (; i < n; i++) {
+        long y = (long)(intptr_t)a[i];
+        if (!lval_is_fix(a[i])) { return 0; }
+        if (max ? y > m : y < m) { m = y; }
+    }
+    *out = lfix_val((lval*)(intptr_t)m);
+    return 1;
+}
+
+LSIMD_TARGET("sse4.2")
+static int lsimd_sum_sse(lval** a, int n, long* out) {
+    const __m128i tag = _mm_set1_epi64x(1);
+    __m128i acc = _mm_setzero_si128();
+    __m128i ovf = _mm_setzero_si128();
+    __m128i tags = tag;
+
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(a + i));
+        tags = _mm_and_si128(tags, v);
+        v = _mm_andnot_si128(tag, v);
+        __m128i r = _mm_add_epi64(acc, v);
+        /* Signed overflow: both inputs differ in sign from the result */
+        ovf = _mm_or_si128(ovf, _mm_and_si128(_mm_xor_si128(acc, r), _mm_xor_si128(v, r)));
+        acc = r;
+    }
+
+    if (!_mm_test_all_ones(_mm_cmpeq_epi64(_mm_and_si128(tags, tag), tag))) { return 0; }
+    if (_mm_movemask_pd(_mm_castsi128_pd(ovf))) { return 0; }
+
+    long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return lsimd_sum_finish(lanes, 2, a, i, n, out);
+}
+
+LSIMD_TARGET("sse4.2")
+static int lsimd_minmax_sse(lval** a, int n, int max, long* out) {
+    const __m128i tag = _mm_set1_epi64x(1);
+    __m128i m = _mm_loadu_si128((const __m128i*)a);
+    __m128i tags = m;
+
+    int i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(a + i));
+        tags = _mm_and_si128(tags, v);
+        __m128i take = max ? _mm_cmpgt_epi64(v, m) : _mm_cmpgt_epi64(m, v);
+        m = _mm_blendv_epi8(m, v, take);
+    }
+
+    if (!_mm_test_all_ones(_mm_cmpeq_epi64(_mm_and_si128(tags, tag), tag))) { return 0; }
+
+    long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, m);
+    return lsimd_minmax_finish(lanes, 2, a, i, n, max, out);
+}
+
+LSIMD_TARGET("sse4.2")
+static int lsimd_has_zero_sse(lval** a, int n) {
+    const __m128i zero = _mm_set1_epi64x((long long)(intptr_t)lfix_make(0));
+    __m128i found = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        found = _mm_or_si128(found, _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*)(a + i)), zero));
+    }
+    if (_mm_movemask_pd(_mm_castsi128_pd(found))) { return 1; }
+    for (; i < n; i++) {
+        if (a[i] == lfix_make(0)) { return 1; }
+    }
+    return 0;
+}
+
+LSIMD_TARGET("avx2")
+static int lsimd_sum_avx2(lval** a, int n, long* out) {
+    const __m256i tag = _mm256_set1_epi64x(1);
+    __m256i acc = _mm256_setzero_si256();
+    __m256i ovf = _mm256_setzero_si256();
+    __m256i tags = tag;
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+        tags = _mm256_and_si256(tags, v);
+        v = _mm256_andnot_si256(tag, v);
+        __m256i r = _mm256_add_epi64(acc, v);
+        ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(acc, r), _mm256_xor_si256(v, r)));
+        acc = r;
+    }
+
+    __m256i tagged = _mm256_cmpeq_epi64(_mm256_and_si256(tags, tag), tag);
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(tagged)) != 0xF) { return 0; }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf))) { return 0; }
+
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lsimd_sum_finish(lanes, 4, a, i, n, out);
+}
+
+LSIMD_TARGET("avx2")
+static int lsimd_minmax_avx2(lval** a, int n, int max, long* out) {
+    const __m256i tag = _mm256_set1_epi64x(1);
+    __m256i m = _mm256_loadu_si256((const __m256i*)a);
+    __m256i tags = m;
+
+    int i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+        tags = _mm256_and_si256(tags, v);
+        __m256i take = max ? _mm256_cmpgt_epi64(v, m) : _mm256_cmpgt_epi64(m, v);
+        m = _mm256_blendv_epi8(m, v, take);
+    }
+
+    __m256i tagged = _mm256_cmpeq_epi64(_mm256_and_si256(tags, tag), tag);
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(tagged)) != 0xF) { return 0; }
+
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, m);
+    return lsimd_minmax_finish(lanes, 4, a, i, n, max, out);
+}
+
+LSIMD_TARGET("avx2")
+static int lsimd_has_zero_avx2(lval** a, int n) {
+    const __m256i zero = _mm256_set1_epi64x((long long)(intptr_t)lfix_make(0));
+    __m256i found = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i)), zero));
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(found))) { return 1; }
+    for (; i < n; i++) {
+        if (a[i] == lfix_make(0)) { return 1; }
+    }
+    return 0;
+}
+
+#endif
+
+/* Pick the widest reductions this CPU supports */
+void lsimd_init(void) {
+#ifdef LSIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lsimd.name = "avx2";
+        lsimd.sum = lsimd_sum_avx2;
+        lsimd.minmax = lsimd_minmax_avx2;
+        lsimd.has_zero = lsimd_has_zero_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        lsimd.name = "sse4.2";
+        lsimd.sum = lsimd_sum_sse;
+        lsimd.minmax = lsimd_minmax_sse;
+        lsimd.has_zero = lsimd_has_zero_sse;
+    }
+#endif
+}
+
+static int lnum_has_zero(lval** a, int n) {
+    if (n >= LSIMD_MIN && lsimd.has_zero) { return lsimd.has_zero(a, n); }
+    for (int i = 0; i < n; i++) {
+        if (a[i] == lfix_make(0)) { return 1; }
+    }
+    return 0;
+}
+
+static lval* lnum_add(lval** a, int n) {
+    long x = 0;
+    if (n >= LSIMD_MIN && lsimd.sum && lsimd.sum(a, n, &x)) { return lval_num(x); }
+
+    /* Count the times the running sum wraps around either end. The exact
+     * sum is x plus that many times 2^64, which only fits if it is none. */
+    long wraps = 0;
+    for (int i = 0; i < n; i++) {
+        long y = lval_numval(a[i]);
+        if (ladd_overflow(x, y, &x)) { wraps += y > 0 ? 1 : -1; }
+    }
+    return wraps ? lnum_overflow() : lval_num(x);
+}
+
+static lval* lnum_sub(lval** a, int n) {
+    long x = lval_numval(a[0]);
+
+    /* If no arguments and op is substraction, perform negation */
+    if (n == 1) {
+        return x == LONG_MIN ? lnum_overflow() : lval_num(-x);
+    }
+
+    long y;
+    if (n >= LSIMD_MIN && lsimd.sum && lsimd.sum(a + 1, n - 1, &y)) {
+        return lsub_overflow(x, y, &x) ? lnum_overflow() : lval_num(x);
+    }
+
+    long wraps = 0;
+    for (int i = 1; i < n; i++) {
+        y = lval_numval(a[i]);
+        if (lsub_overflow(x, y, &x)) { wraps += y > 0 ? -1 : 1; }
+    }
+    return wraps ? lnum_overflow() : lval_num(x);
+}
+
+/* Whether x * y is exactly 2^63, one more than LONG_MAX */
+static int lmul_is_2_63(long x, long y) {
+    if ((x < 0) != (y < 0) || x == 0 || y == 0) { return 0; }
+    unsigned long ux = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    unsigned long uy = y < 0 ? -(unsigned long)y : (unsigned long)y;
+    unsigned long top = 1UL << 63;
+    return top % uy == 0 && ux == top / uy;
+}
+
+static lval* lnum_mul(lval** a, int n) {
+    long x = lval_numval(a[0]);
+    for (int i = 1; i < n && x != 0; i++) {
+        long y = lval_numval(a[i]);
+        long before = x;
+        if (!lmul_overflow(x, y, &x)) { continue; }
+
+        /* Every factor left is at least 1 in size, so only a zero can bring
+         * the product back to 0, and otherwise its size only grows. The one
+         * product out of range whose size fits is 2^63, which -1s can turn
+         * into LONG_MIN. */
+        if (lnum_has_zero(a + i + 1, n - i - 1)) { return lval_num(0); }
+        if (!lmul_is_2_63(before, y)) { return lnum_overflow(); }
+        int negative = 0;
+        for (i++; i < n; i++) {
+            y = lval_numval(a[i]);
+            if (y != 1 && y != -1) { return lnum_overflow(); }
+            negative ^= y == -1;
+        }
+        return negative ? lval_num(LONG_MIN) : lnum_overflow();
+    }
+    return lval_num(x);
+}
+
+static lval* lnum_div(lval** a, int n) {
+    long x = lval_numval(a[0]);
+    for (int i = 1; i < n; i++) {
+        long y = lval_numval(a[i]);
+        if (y == 0) { return lval_err("Division by zero!"); }
+        if (y == -1 && x == LONG_MIN) { return lnum_overflow(); }
+        x /= y;
+    }
+    return lval_num(x);
+}
+
+static lval* lnum_mod(lval** a, int n) {
+    long x = lval_numval(a[0]);
+    for (int i = 1; i < n; i++) {
+        long y = lval_numval(a[i]);
+        if (y == 0) { return lval_err("Division by zero!"); }
+        /* LONG_MIN % -1 is 0, but traps on some machines */
+        x = y == -1 ? 0 : x % y;
+    }
+    return lval_num(x);
+}
+
+static lval* lnum_min(lval** a, int n) {
+    long x;
+    if (n >= LSIMD_MIN && lsimd.minmax && lsimd.minmax(a, n, 0, &x)) { return lval_num(x); }
+
+    x = lval_numval(a[0]);
+    for (int i = 1; i < n; i++) {
+        long y = lval_numval(a[i]);
+        if (y < x) { x = y; }
+    }
+    return lval_num(x);
+}
+
+static lval* lnum_max(lval** a, int n) {
+    long x;
+    if (n >= LSIMD_MIN && lsimd.minmax && lsimd.minmax(a, n, 1, &x)) { return lval_num(x); }
+
+    x = lval_numval(a[0]);
+    for (int i = 1; i < n; i++) {
+        long y = lval_numval(a[i]);
+        if (y > x) { x = y; }
+    }
+    return lval_num(x);
+}
+
+/* Comparisons hold, giving 1, when every neighbouring pair compares true,
+ * and otherwise give 0 */
+#define LNUM_COMPARE(name, cmp) \
+    static lval* name(lval** a, int n) { \
+        for (int i = 1; i < n; i++) { \
+            if (!(lval_numval(a[i - 1]) cmp lval_numval(a[i]))) { return lval_num(0); } \
+        } \
+        return lval_num(1); \
+    }
+
+LNUM_COMPARE(lnum_lt, <)
+LNUM_COMPARE(lnum_gt, >)
+LNUM_COMPARE(lnum_le, <=)
+LNUM_COMPARE(lnum_ge, >=)
+
+/* (== a b) is 1 when a and b are the same value (see lval_eq) and 0 when
+ * they are not, and (!= a b) the other way round. Their hashes are checked
+ * first, and are kept by the lists among them, so comparing a list again
+ * only looks at its elements when the hashes match. */
+static int lval_equal(lval* a, lval* b) {
+    if (a == b) { return 1; }
+    if (lval_hash(a) != lval_hash(b)) { return 0; }
+    return lval_eq(a, b);
+}
+
+lval* builtin_eq(lenv* e, lval** a, int n) {
+    LASSERT((n == 2), "Function '==' passed %i arguments, expected %i!", n, 2);
+    return lval_num(lval_equal(a[0], a[1]));
+}
+
+lval* builtin_ne(lenv* e, lval** a, int n) {
+    LASSERT((n == 2), "Function '!=' passed %i arguments, expected %i!", n, 2);
+    return lval_num(!lval_equal(a[0], a[1]));
+}
+
+lval* builtin_head(lenv* e, lval** a, int n) {
+    /* sanity checks */
+    LASSERT((n == 1), "Function 'head' passed too many arguments! Got %i, expected %i", n, 1); 
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR), "Function 'head' passed incorrect type!");
+
+    LASSERT((a[0]->count != 0), "Function 'head' passed '{}'!");
+    if (a[0]->flags & LFLAG_RRB) { return lval_add(lval_qexpr(), lrrb_get(a[0]->root, 0)); }
+    return lval_view(a[0], 0, 1);
+}
+
+lval* builtin_nth(lenv* e, lval** a, int n) {
+    LASSERT((n == 2), "Function 'nth' passed %i arguments, expected %i!", n, 2);
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR && lval_type(a[1]) == LVAL_NUM),
+        "Function 'nth' passed incorrect type!");
+
+    long i = lval_numval(a[1]);
+    LASSERT((i >= 0 && i < a[0]->count), "Function 'nth' passed index %li out of range!", i);
+    if (a[0]->flags & LFLAG_RRB) { return lrrb_get(a[0]->root, i); }
+    return a[0]->cell[i];
+}
+
+/* (slice q start end) is the elements of q from start up to but not
+ * including end */
+lval* builtin_slice(lenv* e, lval** a, int n) {
+    LASSERT((n == 3), "Function 'slice' passed %i arguments, expected %i!", n, 3);
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR && lval_type(a[1]) == LVAL_NUM && lval_type(a[2]) == LVAL_NUM),
+        "Function 'slice' passed incorrect type!");
+
+    long start = lval_numval(a[1]);
+    long end = lval_numval(a[2]);
+    LASSERT((start >= 0 && start <= end && end <= a[0]->count),
+        "Function 'slice' passed range %li to %li out of range!", start, end);
+    if (a[0]->flags & LFLAG_RRB) {
+        return start == end ? lval_qexpr() : lval_rrb(lrrb_slice(a[0]->root, start, end));
+    }
+    return lval_view(a[0], start, end - start);
+}
+
+lval* builtin_len(lenv* e, lval** a, int n) {
+    /* sanity checks */
+    LASSERT((n == 1), "Function 'len' passed too many arguments!");
+
+    /* Vectors know their length, and may be empty */
+    if (lval_type(a[0]) == LVAL_VEC) { return lval_num(a[0]->count); }
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR), "Function 'len' passed incorrect type!");
+
+    LASSERT((a[0]->count != 0), "Function 'len' passed '{}'!");
+    return lval_num(a[0]->count);
+}
+
+lval* builtin_add(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_add); }
+lval* builtin_sub(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_sub); }
+lval* builtin_mul(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_mul); }
+lval* builtin_div(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_div); }
+lval* builtin_mod(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_mod); }
+lval* builtin_min(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_min); }
+lval* builtin_max(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_max); }
+lval* builtin_lt(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_lt); }
+lval* builtin_gt(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_gt); }
+lval* builtin_le(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_le); }
+lval* builtin_ge(lenv* e, lval** a, int n) { return builtin_op(e, a, n, lnum_ge); }
+
+/* Vectors
+ *
+ * A vector holds its numbers as plain longs packed after the header, so the
+ * builtins working on whole vectors are loops over arrays rather than walks
+ * over lists of pointers. Each of them goes through a kernel in lvec, which
+ * lvec_init points at the AVX2 versions when the CPU has them and otherwise
+ * leaves at the scalar ones. Vectors are made from a Q-Expression of numbers
+ * with vec, turned back into one with vec-list, and never changed once made.
+ *
+ * Overflow is an error, as it is for the arithmetic builtins, and sums are
+ * exact in the same way. The vector kernels for sums give up when a lane
+ * overflows and leave the answer to the scalar ones. AVX2 has no 64 bit
+ * multiply, so products of numbers that fit in 32 bits are taken with
+ * _mm256_mul_epi32 and anything bigger falls back to the scalar code.
+ */
+
+/* Which numbers vec-filter keeps, by how they compare to its bound */
+enum { LVEC_LT, LVEC_GT, LVEC_LE, LVEC_GE };
+
+/* Kernels for the elementwise and whole vector operations. The zip kernels
+ * return 0 on overflow, the others return 0 when they could not give the
+ * exact answer, and the filter returns how many numbers it kept. */
+typedef int (*lvec_zip_fn)(long* x, long* y, long* out, int n);
+typedef int (*lvec_sum_fn)(long* x, int n, long* out);
+typedef int (*lvec_dot_fn)(long* x, long* y, int n, long* out);
+typedef int (*lvec_filter_fn)(long* x, int n, int cmp, long y, long* out);
+
+static int lvec_add_scalar(long* x, long* y, long* out, int n) {
+    int ovf = 0;
+    for (int i = 0; i < n; i++) { ovf |= ladd_overflow(x[i], y[i], &out[i]); }
+    return !ovf;
+}
+
+static int lvec_mul_scalar(long* x, long* y, long* out, int n) {
+    int ovf = 0;
+    for (int i = 0; i < n; i++) { ovf |= lmul_overflow(x[i], y[i], &out[i]); }
+    return !ovf;
+}
+
+static int lvec_sum_scalar(long* x, int n, long* out) {
+    long s = 0;
+    long wraps = 0;
+    for (int i = 0; i < n; i++) {
+        if (ladd_overflow(s, x[i], &s)) { wraps += x[i] > 0 ? 1 : -1; }
+    }
+    *out = s;
+    return wraps == 0;
+}
+
+static int lvec_dot_scalar(long* x, long* y, int n, long* out) {
+    long s = 0;
+    long wraps = 0;
+    for (int i = 0; i < n; i++) {
+        long p;
+        if (lmul_overflow(x[i], y[i], &p)) { return 0; }
+        if (ladd_overflow(s, p, &s)) { wraps += p > 0 ? 1 : -1; }
+    }
+    *out = s;
+    return wraps == 0;
+}
+
+static int lvec_keep(long x, int cmp, long y) {
+    switch (cmp) {
+        case LVEC_LT: return x < y;
+        case LVEC_GT: return x > y;
+        case LVEC_LE: return x <= y;
+        default: return x >= y;
+    }
+}
+
+static int lvec_filter_scalar(long* x, int n, int cmp, long y, long* out) {
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        if (lvec_keep(x[i], cmp, y)) { out[k++] = x[i]; }
+    }
+    return k;
+}
+
+static struct {
+    lvec_zip_fn add;
+    lvec_zip_fn mul;
+    lvec_sum_fn sum;
+    lvec_dot_fn dot;
+    lvec_filter_fn filter;
+} lvec = { lvec_add_scalar, lvec_mul_scalar, lvec_sum_scalar, lvec_dot_scalar, lvec_filter_scalar };
+
+#ifdef LSIMD
+
+/* For each mask of lanes to keep, the 32 bit halves to gather so that the
+ * kept lanes end up at the front, in order */
+static int lvec_compact[16][8];
+
+/* Lanes holding a number that does not fit in 32 bits */
+LSIMD_TARGET("avx2")
+static inline __m256i lvec_wide_avx2(__m256i v) {
+    const __m256i lo = _mm256_set1_epi64x(INT32_MIN);
+    const __m256i hi = _mm256_set1_epi64x(INT32_MAX);
+    return _mm256_or_si256(_mm256_cmpgt_epi64(v, hi), _mm256_cmpgt_epi64(lo, v));
+}
+
+/* Add up the lanes of a sum and the numbers past the last full vector */
+static int lvec_sum_finish(long* lanes, long* x, int i, int n, long s, long* out) {
+    for (int k = 0; k < 4; k++) {
+        if (ladd_overflow(s, lanes[k], &s)) { return 0; }
+    }
+    for (; i < n; i++) {
+        if (ladd_overflow(s, x[i], &s)) { return 0; }
+    }
+    *out = s;
+    return 1;
+}
+
+LSIMD_TARGET("avx2")
+static int lvec_add_avx2(long* x, long* y, long* out, int n) {
+    __m256i ovf = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m256i r = _mm256_add_epi64(a, b);
+        ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(a, r), _mm256_xor_si256(b, r)));
+        _mm256_storeu_si256((__m256i*)(out + i), r);
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf))) { return 0; }
+    return lvec_add_scalar(x + i, y + i, out + i, n - i);
+}
+
+LSIMD_TARGET("avx2")
+static int lvec_mul_avx2(long* x, long* y, long* out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m256i wide = _mm256_or_si256(lvec_wide_avx2(a), lvec_wide_avx2(b));
+        if (_mm256_testz_si256(wide, wide)) {
+            _mm256_storeu_si256((__m256i*)(out + i), _mm256_mul_epi32(a, b));
+        } else if (!lvec_mul_scalar(x + i, y + i, out + i, 4)) {
+            return 0;
+        }
+    }
+    return lvec_mul_scalar(x + i, y + i, out + i, n - i);
+}
+
+LSIMD_TARGET("avx2")
+static int lvec_sum_avx2(long* x, int n, long* out) {
+    __m256i acc = _mm256_setzero_si256();
+    __m256i ovf = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i r = _mm256_add_epi64(acc, v);
+        ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(acc, r), _mm256_xor_si256(v, r)));
+        acc = r;
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf))) { return 0; }
+
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lvec_sum_finish(lanes, x, i, n, 0, out);
+}
+
+LSIMD_TARGET("avx2")
+static int lvec_dot_avx2(long* x, long* y, int n, long* out) {
+    __m256i acc = _mm256_setzero_si256();
+    __m256i ovf = _mm256_setzero_si256();
+    long s = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m256i wide = _mm256_or_si256(lvec_wide_avx2(a), lvec_wide_avx2(b));
+        if (!_mm256_testz_si256(wide, wide)) {
+            long d;
+            if (!lvec_dot_scalar(x + i, y + i, 4, &d) || ladd_overflow(s, d, &s)) { return 0; }
+            continue;
+        }
+        __m256i p = _mm256_mul_epi32(a, b);
+        __m256i r = _mm256_add_epi64(acc, p);
+        ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(acc, r), _mm256_xor_si256(p, r)));
+        acc = r;
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf))) { return 0; }
+
+    long d;
+    if (!lvec_dot_scalar(x + i, y + i, n - i, &d) || ladd_overflow(s, d, &s)) { return 0; }
+
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lvec_sum_finish(lanes, x, n, n, s, out);
+}
+
+/* Compares four at a time, then moves the numbers kept to the front of the
+ * vector with a single permute. Each store writes a whole vector, but only
+ * ever over slots the input has already passed. */
+LSIMD_TARGET("avx2")
+static int lvec_filter_avx2(long* x, int n, int cmp, long y, long* out) {
+    const __m256i b = _mm256_set1_epi64x(y);
+    int flip = cmp == LVEC_LE || cmp == LVEC_GE;
+    int k = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i c = cmp == LVEC_GT || cmp == LVEC_LE ? _mm256_cmpgt_epi64(v, b) : _mm256_cmpgt_epi64(b, v);
+        int m = _mm256_movemask_pd(_mm256_castsi256_pd(c)) ^ (flip ? 0xF : 0);
+        __m256i idx = _mm256_loadu_si256((const __m256i*)lvec_compact[m]);
+        _mm256_storeu_si256((__m256i*)(out + k), _mm256_permutevar8x32_epi32(v, idx));
+        k += __builtin_popcount(m);
+    }
+    return k + lvec_filter_scalar(x + i, n - i, cmp, y, out + k);
+}
+
+#endif
+
+/* Pick the AVX2 kernels if this CPU has them */
+void lvec_init(void) {
+#ifdef LSIMD
+    for (int m = 0; m < 16; m++) {
+        int k = 0;
+        for (int lane = 0; lane < 4; lane++) {
+            if (m & (1 << lane)) {
+                lvec_compact[m][k++] = lane * 2;
+                lvec_compact[m][k++] = lane * 2 + 1;
+            }
+        }
+        while (k < 8) { lvec_compact[m][k++] = 0; }
+    }
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lvec.add = lvec_add_avx2;
+        lvec.mul = lvec_mul_avx2;
+        lvec.sum = lvec_sum_avx2;
+        lvec.dot = lvec_dot_avx2;
+        lvec.filter = lvec_filter_avx2;
+    }
+#endif
+}
+
+lval* builtin_vec(lenv* e, lval** a, int n) {
+    LASSERT((n == 1), "Function 'vec' passed too many arguments!");
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR), "Function 'vec' passed incorrect type!");
+
+    lval* q = lval_flat(a[0]);
+    for (int i = 0; i < q->count; i++) {
+        LASSERT((lval_type(q->cell[i]) == LVAL_NUM), "Function 'vec' passed non-number!");
+    }
+
+    lval* v = lval_vec(q->count);
+    for (int i = 0; i < q->count; i++) { lval_vec_items(v)[i] = lval_numval(q->cell[i]); }
+    return v;
+}
+
+lval* builtin_vec_list(lenv* e, lval** a, int n) {
+    LASSERT((n == 1), "Function 'vec-list' passed too many arguments!");
+
+    LASSERT((lval_type(a[0]) == LVAL_VEC), "Function 'vec-list' passed incorrect type!");
+
+    lval* v = a[0];
+    lval* x = lval_list(LVAL_QEXPR, v->count);
+    x->count = v->count;
+    for (int i = 0; i < x->count; i++) { x->cell[i] = lval_num(lval_vec_items(v)[i]); }
+    return x;
+}
+
+/* Check the arguments of a builtin taking two vectors of the same length,
+ * giving an error if they are wrong */
+static lval* lvec_pair(char* name, lval** a, int n) {
+    LASSERT((n == 2), "Function '%s' passed %i arguments, expected %i!", name, n, 2);
+
+    LASSERT((lval_type(a[0]) == LVAL_VEC && lval_type(a[1]) == LVAL_VEC),
+        "Function '%s' passed incorrect type!", name);
+
+    LASSERT((a[0]->count == a[1]->count), "Function '%s' passed vectors of different lengths!", name);
+    return NULL;
+}
+
+static lval* lvec_zip(char* name, lval** a, int n, lvec_zip_fn k) {
+    lval* err = lvec_pair(name, a, n);
+    if (err) { return err; }
+
+    lval* v = lval_vec(a[0]->count);
+    if (!k(lval_vec_items(a[0]), lval_vec_items(a[1]), lval_vec_items(v), v->count)) {
+        lval_del(v);
+        return lnum_overflow();
+    }
+    return v;
+}
+
+lval* builtin_vec_add(lenv* e, lval** a, int n) { return lvec_zip("vec-add", a, n, lvec.add); }
+lval* builtin_vec_mul(lenv* e, lval** a, int n) { return lvec_zip("vec-mul", a, n, lvec.mul); }
+
+lval* builtin_vec_sum(lenv* e, lval** a, int n) {
+    LASSERT((n == 1), "Function 'vec-sum' passed too many arguments!");
+
+    LASSERT((lval_type(a[0]) == LVAL_VEC), "Function 'vec-sum' passed incorrect type!");
+
+    long* x = lval_vec_items(a[0]);
+    long s;
+    if (lvec.sum(x, a[0]->count, &s) || lvec_sum_scalar(x, a[0]->count, &s)) { return lval_num(s); }
+    return lnum_overflow();
+}
+
+lval* builtin_vec_dot(lenv* e, lval** a, int n) {
+    lval* err = lvec_pair("vec-dot", a, n);
+    if (err) { return err; }
+
+    long* x = lval_vec_items(a[0]);
+    long* y = lval_vec_items(a[1]);
+    long s;
+    if (lvec.dot(x, y, a[0]->count, &s) || lvec_dot_scalar(x, y, a[0]->count, &s)) { return lval_num(s); }
+    return lnum_overflow();
+}
+
+/* (vec-filter > v x) is the vector of the numbers in v greater than x, and
+ * likewise for <, <= and >= */
+lval* builtin_vec_filter(lenv* e, lval** a, int n) {
+    LASSERT((n == 3), "Function 'vec-filter' passed %i arguments, expected %i!", n, 3);
+
+    int cmp = -1;
+    if (lval_type(a[0]) == LVAL_FUN) {
+        if (a[0]->fun == builtin_lt) { cmp = LVEC_LT; }
+        if (a[0]->fun == builtin_gt) { cmp = LVEC_GT; }
+        if (a[0]->fun == builtin_le) { cmp = LVEC_LE; }
+        if (a[0]->fun == builtin_ge) { cmp = LVEC_GE; }
+    }
+    LASSERT((cmp != -1), "Function 'vec-filter' needs one of < > <= >= to compare with!");
+
+    LASSERT((lval_type(a[1]) == LVAL_VEC && lval_type(a[2]) == LVAL_NUM),
+        "Function 'vec-filter' passed incorrect type!");
+
+    /* Filter into scratch space first, the result is sized to fit */
+    int count = a[1]->count;
+    long* kept = malloc(sizeof(long) * (count ? count : 1));
+    int k = lvec.filter(lval_vec_items(a[1]), count, cmp, lval_numval(a[2]), kept);
+
+    lval* v = lval_vec(k);
+    memcpy(lval_vec_items(v), kept, sizeof(long) * k);
+    free(kept);
+    return v;
+}
+
+/* Declare environment struct.
+ *
+ * Bindings live in an open addressing hash table with linear probing, keyed
+ * on the symbol's atom. Atoms are unique, so a probe compares pointers and
+ * the hash is the one computed when the name was interned. The table doubles
+ * whenever it would pass half full, so lookups stay constant time however
+ * many symbols get defined.
+ *
+ * version changes whenever a binding is added, which is the only time slots
+ * move or an unbound symbol can become bound. Until then a slot found for a
+ * symbol stays its slot, whatever it gets rebound to, so compiled code
+ * caches the slots it finds along with the version it found them in (see
+ * LOP_GLOBAL). Only compiled code has such caches: lambda bodies, and top
+ * level expressions under --vm. The tree walker, which runs top level
+ * expressions by default, looks each symbol up every time it meets it,
+ * since a symbol in the tree is the atom itself, shared by every place the
+ * name is used, and has nowhere of its own to keep a slot.
+ */
+typedef struct {
+    lval* sym;
+    lval* val;
+} lenv_slot;
+
+struct lenv {
+    int count;
+    int size;
+    lenv_slot* slots;
+    unsigned long version;
+};
+
+#define LENV_MIN_SIZE 32
+
+lenv* lenv_new(void) {
+    lenv* e = malloc(sizeof(lenv));
+    e->count = 0;
+    e->size = LENV_MIN_SIZE;
+    /* Caches start out at 0, which is never current */
+    e->version = 1;
+    e->slots = calloc(e->size, sizeof(lenv_slot));
+    return e;
+}
+
+void lenv_del(lenv* e) {
+    /* Loop through each binding and release its value. Collected values are
+     * left to lgc_cleanup. */
+    for (int i = 0; i < e->size; i++) {
+        if (e->slots[i].sym) { lval_release(e->slots[i].val); }
+    }
+    free(e->slots);
+    free(e);
+}
+
+/* Slot holding k, or the empty slot where it would go */
+lenv_slot* lenv_find(lenv* e, lval* k) {
+    unsigned long mask = e->size - 1;
+    unsigned long i = k->hash & mask;
+    while (e->slots[i].sym && e->slots[i].sym != k) { i = (i + 1) & mask; }
+    return &e->slots[i];
+}
+
+/* Double the table and reinsert every binding */
+void lenv_grow(lenv* e) {
+    int old_size = e->size;
+    lenv_slot* old = e->slots;
+
+    e->size = old_size * 2;
+    e->slots = calloc(e->size, sizeof(lenv_slot));
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].sym) { *lenv_find(e, old[i].sym) = old[i]; }
+    }
+    free(old);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    lenv_slot* s = lenv_find(e, k);
+    /* If the symbol is bound, lend out the value itself */
+    if (s->sym) { return s->val; }
+    return lval_err("unbound symbol '%s'", k->str);
+}
+
+void lgc_share(lval* v);
+void lgc_remember(lval* k);
+
+void lenv_put(lenv* e, lval* k, lval*v) {
+    /* Under the collector the binding points at v itself, otherwise it gets
+     * its own promoted reference */
+    if (gc.enabled) {
+        lgc_share(v);
+        if (!lval_is_fix(v) && (v->flags & (LFLAG_YOUNG | LFLAG_FRESH))) {
+            lgc_remember(k);
+        }
+    } else {
+        v = lhcons_value(lval_promote(v));
+    }
+
+    lenv_slot* s = lenv_find(e, k);
+
+    /* If variable is found, release val at that position and replace with new
+     * value. The old value may still be borrowed by the current expression. */
+    if (s->sym) {
+        lval* old = s->val;
+        s->val = v;
+        lregion_defer_release(old);
+        return;
+    }
+
+    /* Keep the table at most half full */
+    e->version++;
+    if ((e->count + 1) * 2 > e->size) {
+        lenv_grow(e);
+        s = lenv_find(e, k);
+    }
+
+    /* Store the value and the atom for the symbol */
+    e->count++;
+    s->sym = k;
+    s->val = v;
+}
+
+/* Push v onto the collector's work list unless it is already marked.
+ * Young values a major collection marks are remembered so the mark can be
+ * cleared again without sweeping the nursery. */
+static void lgc_mark_push(lval* v, int flag) {
+    if (lval_is_fix(v) || (v->flags & (LFLAG_ATOM | flag))) { return; }
+    v->flags |= flag;
+    if (flag == LFLAG_MARK && (v->flags & LFLAG_YOUNG)) {
+        lstack_push(&gc.young_marked, v);
+    }
+    lstack_push(&gc.marks, v);
+}
+
+/* Set flag on everything reachable from the work list */
+static void lgc_mark_drain(int flag) {
+    while (gc.marks.count) {
+        lval* v = lstack_pop(&gc.marks);
+        if (v->type == LVAL_NODE) {
+            for (int i = 0; i < v->count; i++) { lgc_mark_push(lrrb_kids(v)[i], flag); }
+        } else if (v->flags & LFLAG_RRB) {
+            lgc_mark_push(v->root, flag);
+        } else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+            for (int i = 0; i < v->count; i++) { lgc_mark_push(v->cell[i], flag); }
+            if (v->flags & LFLAG_VIEW) { lgc_mark_push(v->base, flag); }
+        } else if (v->type == LVAL_LAMBDA) {
+            for (int i = 0; i < v->count; i++) { lgc_mark_push(lval_captures(v)[i], flag); }
+            lgc_mark_push(v->proto, flag);
+        } else if (v->type == LVAL_PROTO) {
+            lgc_mark_push(v->consts, flag);
+        }
+    }
+}
+
+/* Flag v and everything under it as shared with the environment, or with
+ * a lambda it is passed to. Values that are already shared are not walked
+ * again. */
+void lgc_share(lval* v) {
+    lgc_mark_push(v, LFLAG_SHARED);
+    lgc_mark_drain(LFLAG_SHARED);
+}
+
+/* Write barrier: k is now bound to a value that may point into the nursery */
+void lgc_remember(lval* k) {
+    lstack_push(&gc.remembered, k);
+}
+
+static void lgc_free(lval* v) {
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && !(v->flags & (LFLAG_VIEW | LFLAG_RRB))
+        && v->cell != lval_inline_cells(v)) {
+        lcells_free(v->cell, v->cap);
+    }
+    lval_pool_release(v, lval_size(v));
+}
+
+static void lgc_pause_record(lgc_pauses* p, clock_t start) {
+    double t = (double)(clock() - start) / CLOCKS_PER_SEC;
+    int b = 0;
+    for (double limit = 1e-5; b < LGC_PAUSE_BUCKETS - 1 && t >= limit; limit *= 10) { b++; }
+    p->count++;
+    p->total += t;
+    if (t > p->max) { p->max = t; }
+    p->buckets[b]++;
+}
+
+void lgc_collect(void) {
+    clock_t start = clock();
+
+    /* Mark everything reachable from the environment and the root stack */
+    for (int i = 0; i < gc.env->size; i++) {
+        if (gc.env->slots[i].sym) { lgc_mark_push(gc.env->slots[i].val, LFLAG_MARK); }
+    }
+    for (long i = 0; i < gc.roots.count; i++) {
+        lgc_mark_push(gc.roots.items[i], LFLAG_MARK);
+    }
+    for (long i = 0; i < lvm_stack.count; i++) {
+        lgc_mark_push(lvm_stack.items[i], LFLAG_MARK);
+    }
+    lgc_mark_drain(LFLAG_MARK);
+
+    /* The nursery is only freed by minor collections */
+    while (gc.young_marked.count) {
+        lstack_pop(&gc.young_marked)->flags &= ~LFLAG_MARK;
+    }
+
+    /* Sweep the rest of the old generation, compacting the survivors to the
+     * front and keeping track of where this epoch's objects start */
+    long kept = 0;
+    long epoch_start = 0;
+    for (long i = 0; i < gc.objects.count; i++) {
+        if (i == gc.epoch_start) { epoch_start = kept; }
+        lval* v = gc.objects.items[i];
+        if (v->flags & LFLAG_MARK) {
+            v->flags &= ~LFLAG_MARK;
+            gc.objects.items[kept++] = v;
+        } else {
+            lgc_free(v);
+        }
+    }
+    if (gc.epoch_start >= gc.objects.count) { epoch_start = kept; }
+
+    gc.stats.collections++;
+    gc.stats.freed += gc.objects.count - kept;
+    gc.stats.live = kept;
+    gc.objects.count = kept;
+    gc.epoch_start = epoch_start;
+
+    /* Let the heap double before the next collection */
+    gc.threshold = kept * 2 > LGC_MIN_THRESHOLD ? kept * 2 : LGC_MIN_THRESHOLD;
+
+    lgc_pause_record(&gc.stats.major_pauses, start);
+}
+
+void lgc_maybe_collect(void) {
+    if (gc.objects.count >= gc.threshold) { lgc_collect(); }
+}
+
+/* Return where v lives after the minor collection, copying it out of the
+ * nursery if it is young. Old values allocated this epoch may point into
+ * the nursery, so they are queued for scanning the first time they are seen,
+ * as are the copies. */
+static lval* lgc_promote(lval* v) {
+    if (lval_is_fix(v)) { return v; }
+    if (v->flags & LFLAG_FWD) { return v->forward; }
+    if (v->flags & LFLAG_FRESH) {
+        v->flags &= ~LFLAG_FRESH;
+        lstack_push(&gc.marks, v);
+        return v;
+    }
+    if (!(v->flags & LFLAG_YOUNG)) { return v; }
+
+    size_t size = lval_size(v);
+    lval* x = lval_pool_alloc(size);
+    memcpy(x, v, size);
+    x->flags = v->flags & ~(LFLAG_YOUNG | LFLAG_VIEW);
+    lstack_push(&gc.objects, x);
+    if (v->type == LVAL_NODE || v->type == LVAL_LAMBDA || v->type == LVAL_PROTO || (v->flags & LFLAG_RRB)) {
+        lstack_push(&gc.marks, x);
+    } else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        /* Views get cells of their own, and inline cells move with the copy */
+        x->refs = 1;
+        lval_cells_reserve(x, v->count);
+        if (v->count) { memcpy(x->cell, v->cell, sizeof(lval*) * v->count); }
+        lstack_push(&gc.marks, x);
+    }
+
+    v->flags |= LFLAG_FWD;
+    v->forward = x;
+    gc.stats.promoted++;
+    return x;
+}
+
+/* Copy everything the remembered bindings can reach out of the nursery and
+ * start a new one. Only called between top level expressions, when nothing
+ * else can point into it. */
+void lgc_minor(void) {
+    clock_t start = clock();
+
+    for (long i = 0; i < gc.remembered.count; i++) {
+        lenv_slot* s = lenv_find(gc.env, gc.remembered.items[i]);
+        if (s->sym) { s->val = lgc_promote(s->val); }
+    }
+    while (gc.marks.count) {
+        lval* v = lstack_pop(&gc.marks);
+        if (v->type == LVAL_NODE) {
+            for (int i = 0; i < v->count; i++) { lrrb_kids(v)[i] = lgc_promote(lrrb_kids(v)[i]); }
+            continue;
+        }
+        if (v->flags & LFLAG_RRB) {
+            v->root = lgc_promote(v->root);
+            continue;
+        }
+        if (v->type == LVAL_LAMBDA) {
+            for (int i = 0; i < v->count; i++) { lval_captures(v)[i] = lgc_promote(lval_captures(v)[i]); }
+            v->proto = lgc_promote(v->proto);
+            continue;
+        }
+        if (v->type == LVAL_PROTO) {
+            v->consts = lgc_promote(v->consts);
+            continue;
+        }
+        if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { continue; }
+
+        /* An old view may be borrowing cells from the nursery, and its
+         * cells are about to be changed, so it gets its own first */
+        if (v->flags & LFLAG_VIEW) {
+            lval** cell = v->cell;
+            v->flags &= ~LFLAG_VIEW;
+            v->refs = 1;
+            lval_cells_reserve(v, v->count);
+            if (v->count) { memcpy(v->cell, cell, sizeof(lval*) * v->count); }
+        }
+        for (int i = 0; i < v->count; i++) { v->cell[i] = lgc_promote(v->cell[i]); }
+    }
+
+    for (long i = gc.epoch_start; i < gc.objects.count; i++) {
+        gc.objects.items[i]->flags &= ~LFLAG_FRESH;
+    }
+    gc.epoch_start = gc.objects.count;
+    gc.remembered.count = 0;
+    lbump_reset(&gc.nursery);
+
+    gc.stats.minors++;
+    lgc_pause_record(&gc.stats.minor_pauses, start);
+}
+
+/* Switch to the collector, with e as the root environment. Must happen
+ * before anything is allocated. */
+void lgc_enable(lenv* e) {
+    gc.enabled = 1;
+    gc.env = e;
+    gc.threshold = LGC_MIN_THRESHOLD;
+}
+
+void lgc_cleanup(void) {
+    for (long i = 0; i < gc.objects.count; i++) { lgc_free(gc.objects.items[i]); }
+    lstack_free(&gc.objects);
+    lstack_free(&gc.roots);
+    lstack_free(&gc.remembered);
+    lstack_free(&gc.marks);
+    lstack_free(&gc.young_marked);
+    lbump_destroy(&gc.nursery);
+    gc.epoch_start = 0;
+}
+
+static void lgc_pauses_print(const char* name, lgc_pauses* p) {
+    static const char* labels[LGC_PAUSE_BUCKETS] = {
+        "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms"
+    };
+    printf("gc %s pauses: %li total: %.3fms max: %.3fms\n", name, p->count,
+        p->total * 1e3, p->max * 1e3);
+    printf("   ");
+    for (int i = 0; i < LGC_PAUSE_BUCKETS; i++) { printf(" %s: %li", labels[i], p->buckets[i]); }
+    printf("\n");
+}
+
+void lgc_stats_print(void) {
+    printf("gc collections: %li freed: %li live: %li\n",
+        gc.stats.collections, gc.stats.freed, gc.stats.live);
+    printf("gc minor collections: %li promoted: %li\n",
+        gc.stats.minors, gc.stats.promoted);
+    lgc_pauses_print("minor", &gc.stats.minor_pauses);
+    lgc_pauses_print("major", &gc.stats.major_pauses);
+}
+
+/* Start and finish evaluating a top level expression: in a region, or with
+ * the collector getting a chance to run once the result is done with */
+void leval_begin(void) {
+    if (!gc.enabled) { lregion_begin(); }
+}
+
+void leval_end(void) {
+    if (gc.enabled) {
+        lgc_minor();
+        lgc_maybe_collect();
+    } else {
+        lregion_end();
+    }
+}
+
+/* Native code for hot arithmetic
+ *
+ * On x86-64 the compiler looks for maximal S-Expressions in lambda bodies
+ * built only from +, -, * and / applied to numbers, symbols and more such
+ * S-Expressions, and puts LOP_NATIVE in front of the ordinary code for each.
+ * Bodies run over and over, and native code only pays for itself there: a
+ * top level expression runs once, and so gets none. A site counts its runs,
+ * and only when it has run LJIT_HOT times is it translated into machine code
+ * taking the numbers and the symbols' values as an array of longs. Until
+ * then it costs a count and nothing else: in particular cold code is never
+ * keyed. The machine code is kept in a table keyed on the expression's
+ * shape, the operators with the numbers and symbols left out, so that every
+ * site of one shape shares it.
+ *
+ * Every symbol is resolved when the body is compiled, the same way the
+ * ordinary code resolves it, to an argument, a capture or a global, and the
+ * slots of the globals and of the operators are cached the way LOP_GLOBAL
+ * caches them. Before calling the native code LOP_NATIVE checks that the
+ * operators are still bound to the builtins and that every symbol's value
+ * is a number, and the native code itself gives up on overflow and division
+ * by zero. In any of those cases the ordinary code runs instead, so errors
+ * come from the builtins exactly as they would have; the expression has no
+ * side effects, so it is safe to start it over. Otherwise the result is
+ * boxed with lval_num and the ordinary code is jumped over.
+ *
+ * Build with -DLJIT_DISABLE, or run with --no-jit, to go without.
+ */
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && !defined(LJIT_DISABLE)
+#define LJIT
+#include <sys/mman.h>
+#endif
+
+/* Runs of a site before it gets native code */
+#ifndef LJIT_HOT
+#define LJIT_HOT 16
+#endif
+
+#define LJIT_PAGE_SIZE (64 * 1024)
+
+/* Deepest nesting of a shape, which its code is generated recursively for */
+#define LJIT_MAX_DEPTH 64
+
+/* Operators, as bits of a mask and indexes into ljit.ops */
+#define LJIT_OPS 4
+enum { LJIT_ADD, LJIT_SUB, LJIT_MUL, LJIT_DIV };
+
+/* Returns 0 to give up, otherwise stores the result in *out */
+typedef int (*ljit_fn)(long* leaves, long* out);
+
+/* Native code for a shape */
+typedef struct {
+    char* key;
+    unsigned long hash;
+    ljit_fn fn;
+} ljit_entry;
+
+/* Where the value of a leaf comes from: the number itself, the i'th
+ * argument of the lambda, the i'th value it captured, or a global */
+enum { LJIT_CONST, LJIT_LOCAL, LJIT_FREE, LJIT_GLOBAL };
+
+typedef struct {
+    int kind;
+    int index;
+    long value;
+    lval* sym;
+    lenv_slot* slot;
+} ljit_leaf;
+
+/* An arithmetic expression in a lambda body: the expression, how often it
+ * has run while cold, or -1 if it cannot have native code, its native code
+ * once hot, the length of the ordinary code that follows its LOP_NATIVE and
+ * where that LOP_NATIVE's operand is, the operators it uses, the slots of
+ * those and of its global leaves with the environment version they were
+ * found in, and its leaves, in order. Sites live in the compiled body after
+ * its code (see lproto_finish). */
+typedef struct ljit_site {
+    struct ljit_site* next;
+    lval* expr;
+    int runs;
+    ljit_fn fn;
+    int skip;
+    int at;
+    int ops;
+    unsigned long version;
+    lenv_slot* op_slots[LJIT_OPS];
+    int count;
+    ljit_leaf leaves[];
+} ljit_site;
+
+typedef struct {
+    char* bytes;
+    int count;
+    int cap;
+} ljit_buf;
+
+typedef struct ljit_page {
+    struct ljit_page* next;
+    char* base;
+    size_t size;
+    size_t used;
+} ljit_page;
+
+static struct {
+    int enabled;
+
+    /* Shapes with native code, in an open addressing table keyed on their
+     * text */
+    ljit_entry** entries;
+    int size;
+    int count;
+
+    ljit_page* pages;
+    lval* ops[LJIT_OPS];
+
+    /* Scratch space for keys, code, the branches to the bail out code and
+     * the leaves' values */
+    ljit_buf key;
+    ljit_buf code;
+    int* fails;
+    int fail_count;
+    int fail_cap;
+    long* args;
+    int args_cap;
+
+    struct {
+        long functions;
+        long bytes;
+        long runs;
+        long bailouts;
+    } stats;
+} ljit;
+
+static lbuiltin ljit_builtins[LJIT_OPS] = { builtin_add, builtin_sub, builtin_mul, builtin_div };
+
+void ljit_enable(void) {
+#ifdef LJIT
+    ljit.enabled = 1;
+    ljit.ops[LJIT_ADD] = lval_sym("+");
+    ljit.ops[LJIT_SUB] = lval_sym("-");
+    ljit.ops[LJIT_MUL] = lval_sym("*");
+    ljit.ops[LJIT_DIV] = lval_sym("/");
+#endif
+}
+
+static void ljit_put(ljit_buf* b, const void* bytes, int n) {
+    if (b->count + n > b->cap) {
+        while (b->count + n > b->cap) { b->cap = b->cap ? b->cap * 2 : 256; }
+        b->bytes = realloc(b->bytes, b->cap);
+    }
+    memcpy(b->bytes + b->count, bytes, n);
+    b->count += n;
+}
+
+/* Operator s stands for, or -1 */
+static int ljit_op(lval* s) {
+    if (lval_type(s) != LVAL_SYM || s->str[1] != '\0') { return -1; }
+    switch (s->str[0]) {
+        case '+': return LJIT_ADD;
+        case '-': return LJIT_SUB;
+        case '*': return LJIT_MUL;
+        case '/': return LJIT_DIV;
+    }
+    return -1;
+}
+
+/* Whether v is arithmetic and nested no deeper than LJIT_MAX_DEPTH from
+ * depth, counting its leaves and noting its operators */
+static int ljit_arith(lval* v, int depth, int* leaves, int* ops) {
+    if (lval_type(v) != LVAL_SEXPR || v->count < 2 || depth > LJIT_MAX_DEPTH) { return 0; }
+    int op = ljit_op(v->cell[0]);
+    if (op < 0) { return 0; }
+    *ops |= 1 << op;
+
+    for (int i = 1; i < v->count; i++) {
+        int t = lval_type(v->cell[i]);
+        if (t == LVAL_NUM || t == LVAL_SYM) {
+            (*leaves)++;
+        } else if (!ljit_arith(v->cell[i], depth + 1, leaves, ops)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void ljit_key(ljit_buf* b, lval* v) {
+    ljit_put(b, "(", 1);
+    ljit_put(b, v->cell[0]->str, 1);
+    for (int i = 1; i < v->count; i++) {
+        lval* x = v->cell[i];
+        ljit_put(b, " ", 1);
+        if (lval_type(x) == LVAL_SEXPR) { ljit_key(b, x); } else { ljit_put(b, "#", 1); }
+    }
+    ljit_put(b, ")", 1);
+}
+
+#ifdef LJIT
+
+/* x86-64 code generation. The leaves arrive in rdi and the result goes to
+ * [rsi]. Values are computed in rax, with the right hand operand in rcx and
+ * partial results saved on the machine stack; rbx holds the stack pointer
+ * to restore when bailing out from inside an expression. */
+
+static void ljit_put32(ljit_buf* b, int32_t x) { ljit_put(b, &x, 4); }
+static void ljit_put64(ljit_buf* b, int64_t x) { ljit_put(b, &x, 8); }
+
+/* Jump to the bail out code, patched in once it is placed */
+static void ljit_put_fail(ljit_buf* b, const char* jcc) {
+    ljit_put(b, jcc, 2);
+    if (ljit.fail_count == ljit.fail_cap) {
+        ljit.fail_cap = ljit.fail_cap ? ljit.fail_cap * 2 : 64;
+        ljit.fails = realloc(ljit.fails, sizeof(int) * ljit.fail_cap);
+    }
+    ljit.fails[ljit.fail_count++] = b->count;
+    ljit_put32(b, 0);
+}
+
+/* mov rax/rcx, [rdi + 8 * leaf] */
+static void ljit_put_leaf(ljit_buf* b, int rcx, int* leaf) {
+    ljit_put(b, rcx ? "\x48\x8B\x8F" : "\x48\x8B\x87", 3);
+    ljit_put32(b, 8 * (*leaf)++);
+}
+
+static void ljit_gen(ljit_buf* b, lval* v, int* leaf) {
+    int op = ljit_op(v->cell[0]);
+
+    for (int i = 1; i < v->count; i++) {
+        lval* x = v->cell[i];
+        int is_leaf = lval_type(x) != LVAL_SEXPR;
+
+        if (i == 1) {
+            if (is_leaf) { ljit_put_leaf(b, 0, leaf); } else { ljit_gen(b, x, leaf); }
+            if (op == LJIT_SUB && v->count == 2) {
+                ljit_put(b, "\x48\xF7\xD8", 3);                   /* neg rax */
+                ljit_put_fail(b, "\x0F\x80");                      /* jo fail */
+            }
+            continue;
+        }
+
+        if (is_leaf) {
+            ljit_put_leaf(b, 1, leaf);
+        } else {
+            ljit_put(b, "\x50", 1);                 /* push rax */
+            ljit_gen(b, x, leaf);
+            ljit_put(b, "\x48\x89\xC1", 3);         /* mov rcx, rax */
+            ljit_put(b, "\x58", 1);                 /* pop rax */
+        }
+
+        switch (op) {
+            case LJIT_ADD:
+                ljit_put(b, "\x48\x01\xC8", 3);                        /* add rax, rcx */
+                ljit_put_fail(b, "\x0F\x80");                          /* jo fail */
+                break;
+            case LJIT_SUB:
+                ljit_put(b, "\x48\x29\xC8", 3);                        /* sub rax, rcx */
+                ljit_put_fail(b, "\x0F\x80");                          /* jo fail */
+                break;
+            case LJIT_MUL:
+                ljit_put(b, "\x48\x0F\xAF\xC1", 4);                    /* imul rax, rcx */
+                ljit_put_fail(b, "\x0F\x80");                          /* jo fail */
+                break;
+            case LJIT_DIV:
+                ljit_put(b, "\x48\x85\xC9", 3);                        /* test rcx, rcx */
+                ljit_put_fail(b, "\x0F\x84");                          /* jz fail */
+                ljit_put(b, "\x48\x83\xF9\xFF", 4);                    /* cmp rcx, -1 */
+                ljit_put(b, "\x75\x13", 2);                            /* jne divide */
+                ljit_put(b, "\x48\xBA", 2);                            /* mov rdx, LONG_MIN */
+                ljit_put64(b, LONG_MIN);
+                ljit_put(b, "\x48\x39\xD0", 3);                        /* cmp rax, rdx */
+                ljit_put_fail(b, "\x0F\x84");                          /* je fail */
+                ljit_put(b, "\x48\x99", 2);                            /* divide: cqo */
+                ljit_put(b, "\x48\xF7\xF9", 3);                        /* idiv rcx */
+                break;
+        }
+    }
+}
+
+/* Copy code into executable memory, which is only ever writable or
+ * executable, never both */
+static ljit_fn ljit_install(ljit_buf* b) {
+    size_t n = (b->count + 15) & ~(size_t)15;
+    ljit_page* p = ljit.pages;
+
+    if (p == NULL || p->used + n > p->size) {
+        size_t size = (n + LJIT_PAGE_SIZE - 1) / LJIT_PAGE_SIZE * LJIT_PAGE_SIZE;
+        void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) { return NULL; }
+        p = malloc(sizeof(ljit_page));
+        p->next = ljit.pages;
+        p->base = base;
+        p->size = size;
+        p->used = 0;
+        ljit.pages = p;
+    } else if (mprotect(p->base, p->size, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+
+    char* code = p->base + p->used;
+    memcpy(code, b->bytes, b->count);
+    if (mprotect(p->base, p->size, PROT_READ | PROT_EXEC) != 0) { return NULL; }
+    p->used += n;
+    ljit.stats.bytes += b->count;
+    return (ljit_fn)(void*)code;
+}
+
+static ljit_fn ljit_compile(lval* v) {
+    ljit_buf* b = &ljit.code;
+    b->count = 0;
+    ljit.fail_count = 0;
+
+    ljit_put(b, "\x53", 1);                         /* push rbx */
+    ljit_put(b, "\x48\x89\xE3", 3);                 /* mov rbx, rsp */
+    int leaf = 0;
+    ljit_gen(b, v, &leaf);
+    ljit_put(b, "\x48\x89\x06", 3);                 /* mov [rsi], rax */
+    ljit_put(b, "\x5B", 1);                         /* pop rbx */
+    ljit_put(b, "\xB8\x01\x00\x00\x00", 5);         /* mov eax, 1 */
+    ljit_put(b, "\xC3", 1);                         /* ret */
+
+    for (int i = 0; i < ljit.fail_count; i++) {
+        int32_t rel = b->count - (ljit.fails[i] + 4);
+        memcpy(b->bytes + ljit.fails[i], &rel, 4);
+    }
+    ljit_put(b, "\x48\x89\xDC", 3);                 /* fail: mov rsp, rbx */
+    ljit_put(b, "\x5B", 1);                         /* pop rbx */
+    ljit_put(b, "\x31\xC0", 2);                     /* xor eax, eax */
+    ljit_put(b, "\xC3", 1);                         /* ret */
+
+    return ljit_install(b);
+}
+
+#else
+
+static ljit_fn ljit_compile(lval* v) { return NULL; }
+
+#endif
+
+static void ljit_grow(void) {
+    int old_size = ljit.size;
+    ljit_entry** old = ljit.entries;
+
+    ljit.size = old_size ? old_size * 2 : 64;
+    ljit.entries = calloc(ljit.size, sizeof(ljit_entry*));
+    for (int i = 0; i < old_size; i++) {
+        if (old[i] == NULL) { continue; }
+        unsigned long j = old[i]->hash & (ljit.size - 1);
+        while (ljit.entries[j]) { j = (j + 1) & (ljit.size - 1); }
+        ljit.entries[j] = old[i];
+    }
+    free(old);
+}
+
+/* Native code for the shape of arithmetic expression v, compiled unless
+ * another expression of that shape already has it, or NULL if there is none
+ * to be had */
+static ljit_fn ljit_fn_for(lval* v) {
+    ljit.key.count = 0;
+    ljit_key(&ljit.key, v);
+    ljit_put(&ljit.key, "", 1);
+    unsigned long hash = lintern_hash(ljit.key.bytes);
+
+    if ((ljit.count + 1) * 2 > ljit.size) { ljit_grow(); }
+    unsigned long i = hash & (ljit.size - 1);
+    while (ljit.entries[i]) {
+        ljit_entry* j = ljit.entries[i];
+        if (j->hash == hash && strcmp(j->key, ljit.key.bytes) == 0) { return j->fn; }
+        i = (i + 1) & (ljit.size - 1);
+    }
+
+    ljit_fn fn = ljit_compile(v);
+    if (fn == NULL) { return NULL; }
+    ljit_entry* j = malloc(sizeof(ljit_entry));
+    j->key = malloc(ljit.key.count);
+    memcpy(j->key, ljit.key.bytes, ljit.key.count);
+    j->hash = hash;
+    j->fn = fn;
+    ljit.entries[i] = j;
+    ljit.count++;
+    ljit.stats.functions++;
+    return fn;
+}
+
+/* Find the slots of site s's operators and global leaves in e, giving 0 if
+ * any of them is unbound */
+static int ljit_site_bind(lenv* e, ljit_site* s) {
+    for (int i = 0; i < LJIT_OPS; i++) {
+        if (!(s->ops & (1 << i))) { continue; }
+        s->op_slots[i] = lenv_find(e, ljit.ops[i]);
+        if (!s->op_slots[i]->sym) { return 0; }
+    }
+    for (int i = 0; i < s->count; i++) {
+        ljit_leaf* l = &s->leaves[i];
+        if (l->kind != LJIT_GLOBAL) { continue; }
+        l->slot = lenv_find(e, l->sym);
+        if (!l->slot->sym) { return 0; }
+    }
+    s->version = e->version;
+    return 1;
+}
+
+/* The value of site s's expression, run in the frame of lambda f whose
+ * arguments start at lvm_stack[fp], or NULL to run its ordinary code */
+lval* ljit_run(lenv* e, ljit_site* s, lval* f, long fp) {
+    if (!ljit.enabled) { return NULL; }
+    if (s->fn == NULL) {
+        if (s->runs < 0 || ++s->runs < LJIT_HOT) { return NULL; }
+        s->fn = ljit_fn_for(s->expr);
+        if (s->fn == NULL) {
+            s->runs = -1;
+            return NULL;
+        }
+    }
+
+    if (s->version != e->version && !ljit_site_bind(e, s)) { goto bail; }
+    for (int i = 0; i < LJIT_OPS; i++) {
+        if (!(s->ops & (1 << i))) { continue; }
+        lval* g = s->op_slots[i]->val;
+        if (lval_type(g) != LVAL_FUN || g->fun != ljit_builtins[i]) { goto bail; }
+    }
+
+    if (s->count > ljit.args_cap) {
+        ljit.args_cap = s->count;
+        ljit.args = realloc(ljit.args, sizeof(long) * ljit.args_cap);
+    }
+    for (int i = 0; i < s->count; i++) {
+        ljit_leaf* l = &s->leaves[i];
+        lval* x;
+        switch (l->kind) {
+            case LJIT_CONST: ljit.args[i] = l->value; continue;
+            case LJIT_LOCAL: x = lvm_stack.items[fp + l->index]; break;
+            case LJIT_FREE: x = lval_captures(f)[l->index]; break;
+            default: x = l->slot->val; break;
+        }
+        if (lval_type(x) != LVAL_NUM) { goto bail; }
+        ljit.args[i] = lval_numval(x);
+    }
+
+    long x;
+    if (!s->fn(ljit.args, &x)) { goto bail; }
+    ljit.stats.runs++;
+    return lval_num(x);
+
+bail:
+    ljit.stats.bailouts++;
+    return NULL;
+}
+
+void ljit_cleanup(void) {
+    for (int i = 0; i < ljit.size; i++) {
+        if (ljit.entries[i] == NULL) { continue; }
+        free(ljit.entries[i]->key);
+        free(ljit.entries[i]);
+    }
+    free(ljit.entries);
+#ifdef LJIT
+    while (ljit.pages) {
+        ljit_page* next = ljit.pages->next;
+        munmap(ljit.pages->base, ljit.pages->size);
+        free(ljit.pages);
+        ljit.pages = next;
+    }
+#endif
+    free(ljit.key.bytes);
+    free(ljit.code.bytes);
+    free(ljit.fails);
+    free(ljit.args);
+    memset(&ljit, 0, sizeof(ljit));
+}
+
+void ljit_stats_print(void) {
+    printf("jit functions: %li bytes: %li runs: %li bailouts: %li\n",
+        ljit.stats.functions, ljit.stats.bytes, ljit.stats.runs, ljit.stats.bailouts);
+}
+
+/* Bytecode
+ *
+ * lvm_eval compiles an expression into a flat array of instructions for a
+ * stack machine instead of walking it, which top level expressions go
+ * through under --vm (see leval). Each S-Expression becomes code to push
+ * its elements followed by a single call, so the tree is walked once and
+ * builtins are handed their arguments straight off the operand stack.
+ * Instructions point straight at the values they use, which stay in the
+ * expression the chunk was compiled from, and that is rooted while the chunk
+ * runs. Q-Expression literals are ordinary constants: the reader already
+ * built them, and a chunk only runs once, so the program is free to take
+ * them apart. The bodies of lambdas are compiled the same way, once, and
+ * run with a frame (see llambda). if applied to literal branches compiles
+ * to jumps around them. The code first checks that if is still bound to the
+ * builtin, since a body may well outlive the binding it was compiled with,
+ * and if it is not, calls whatever it is bound to instead:
+ *
+ *   crispy> def {f} (\ {x} {if x {1} {2}})
+ *   crispy> def {if} (\ {c a b} {99})
+ *   crispy> f 1
+ *   99
+ *
+ * The instructions are
+ *
+ *   LOP_CONST v    push v
+ *   LOP_GLOBAL s   push the value bound to symbol s, looked up in the global
+ *                  environment the first time and then read from the slot
+ *                  cached in the two words after s while it stays current
+ *   LOP_LOCAL i    push the lambda's i'th argument
+ *   LOP_FREE i     push the i'th value the lambda captured
+ *   LOP_CLOSURE p  if the value under the top ones, one for each of p's
+ *                  frees, is still \, make a lambda running compiled body p
+ *                  capturing them, in place of it and them, and skip the
+ *                  call of \ that follows; if not, pop them and carry on
+ *   LOP_CALL n     call the function under the top n values with them as
+ *                  arguments, replacing all n + 1 with the result
+ *   LOP_TAILCALL n the same as the last thing the code does, finishing with
+ *                  the result (see Tail calls)
+ *   LOP_IF d       if the value under the top one is still if, pop both
+ *                  and skip the call of if that follows, and d words more if
+ *                  the top one was 0; if not, carry on into the call
+ *   LOP_JUMP d     skip d words of code
+ *   LOP_NATIVE s   run the native code for site s (see ljit_run), and if it
+ *                  gives a value push it and skip the ordinary code after
+ *   LOP_RETURN     finish with the value on top of the stack
+ *
+ * Every instruction is two words, the opcode and its operand, apart from
+ * LOP_GLOBAL, which is four with its inline cache. Code is walked by
+ * stepping over them without decoding anything else.
+ *
+ * With GCC or Clang the VM is direct threaded: the compiler emits the address
+ * of the code handling each instruction in place of its opcode, and every
+ * handler ends by jumping straight to the next one. That saves the switch's
+ * bounds check and jump table load, and gives each handler its own indirect
+ * branch for the predictor to learn, without a pass over the code to swap
+ * the opcodes for addresses before it runs. Other compilers, or a build with
+ * -DLVM_SWITCH, get the plain switch.
+ */
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LVM_SWITCH)
+#define LVM_THREADED
+#endif
+
+#ifdef LVM_THREADED
+/* Addresses of the handlers, in opcode order, filled in by lvm_init */
+static void** lvm_handlers;
+#endif
+
+enum {
+    LOP_CONST, LOP_GLOBAL, LOP_LOCAL, LOP_FREE, LOP_CLOSURE, LOP_CALL, LOP_TAILCALL,
+    LOP_IF, LOP_JUMP, LOP_NATIVE, LOP_RETURN
+};
+
+/* Words of the ordinary call following LOP_IF and LOP_CLOSURE, made when if
+ * or \ has been rebound since the code was compiled */
+enum { LIF_CALL = 8, LCLOSURE_CALL = 6 };
+
+/* Names in scope while compiling the body of a lambda. consts is the list
+ * the body's compiled form will keep (see lproto_code), whose third cell
+ * collects the names captured from the scopes around it. */
+typedef struct lscope {
+    struct lscope* up;
+    lval* formals;
+    lval* consts;
+} lscope;
+
+typedef struct {
+    lcode* code;
+    int count;
+    int cap;
+    lval* src;
+
+    /* Environment the code runs in, and the lambda whose body is being
+     * compiled, or NULL at the top level */
+    lenv* env;
+    lscope* scope;
+
+    /* Native code sites, and whether an arithmetic expression is being
+     * compiled so that its parts are not considered on their own */
+    ljit_site* sites;
+    int arith;
+} lchunk;
+
+/* The body of a lambda being compiled, with the names in scope there */
+typedef struct {
+    lchunk c;
+    lscope sc;
+} lproto_build;
+
+static void lchunk_word(lchunk* c, lcode w) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->code = realloc(c->code, sizeof(lcode) * c->cap);
+    }
+    c->code[c->count++] = w;
+}
+
+static void lchunk_emit(lchunk* c, int op, lcode arg) {
+#ifdef LVM_THREADED
+    lchunk_word(c, (lcode)lvm_handlers[op]);
+#else
+    lchunk_word(c, op);
+#endif
+    lchunk_word(c, arg);
+}
+
+void lval_compile_sym(lchunk* c, lval* s);
+int llambda_form(lchunk* c, lval* v);
+static int lscope_lookup(lscope* sc, lval* s, int* slot);
+static int lscope_capture(lscope* sc, lval* s);
+lval* builtin_if(lenv* e, lval** a, int n);
+lval* builtin_lambda(lenv* e, lval** a, int n);
+
+static lproto_build* lproto_begin(lenv* e, lscope* up, lval* formals, lval* body);
+static void lval_compile_closure(lchunk* c, lproto_build* b, int tail);
+
+/* The compiler keeps the work it has left on a stack of its own instead of
+ * recursing, so how deep expressions nest is only limited by memory. Each
+ * task emits some code, then pushes the tasks for what follows in reverse
+ * order: an S-Expression pushes the calls applying it under the tasks
+ * compiling its elements. */
+enum { LC_EXPR, LC_BRANCH, LC_CALL, LC_IF, LC_JUMP, LC_LAND, LC_CLOSURE };
+
+typedef struct {
+    unsigned char kind;
+    unsigned char tail;
+
+    /* LC_CALL: whether it ends an arithmetic expression, the number of
+     * arguments, and where the ordinary code of its native site starts.
+     * LC_IF and LC_JUMP: the task to tell where their operand is, which
+     * LC_JUMP and LC_LAND patch. LC_LAND patches the jump after the call
+     * LC_IF makes, which it is told the end of in n. */
+    unsigned char arith;
+    int n;
+    int at;
+
+    lchunk* c;
+    union {
+        lval* v;
+        ljit_site* site;
+        lproto_build* proto;
+    };
+} lcomp_task;
+
+static struct {
+    lcomp_task* items;
+    long count;
+    long cap;
+} lcomp;
+
+static long lcomp_push(int kind, lchunk* c, lval* v, int tail) {
+    lcomp.items = lgrow(lcomp.items, lcomp.count, &lcomp.cap, sizeof(lcomp_task));
+    lcomp.items[lcomp.count] = (lcomp_task){ .kind = kind, .tail = tail, .c = c, .v = v };
+    return lcomp.count++;
+}
+
+/* Resolve the leaves of arithmetic expression v into site s as the code in
+ * c would, giving 0 if one of its operators is not global there */
+static int ljit_site_leaves(lchunk* c, lval* v, ljit_site* s) {
+    int slot;
+    if (lscope_lookup(c->scope, v->cell[0], &slot) >= 0) { return 0; }
+    for (int i = 1; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if (lval_type(x) == LVAL_SEXPR) {
+            if (!ljit_site_leaves(c, x, s)) { return 0; }
+            continue;
+        }
+
+        ljit_leaf* l = &s->leaves[s->count++];
+        if (lval_type(x) == LVAL_NUM) {
+            l->kind = LJIT_CONST;
+            l->value = lval_numval(x);
+            continue;
+        }
+        int depth = lscope_lookup(c->scope, x, &slot);
+        if (depth < 0) {
+            l->kind = LJIT_GLOBAL;
+            l->sym = x;
+        } else if (depth == 0) {
+            l->kind = LJIT_LOCAL;
+            l->index = slot;
+        } else {
+            l->kind = LJIT_FREE;
+            l->index = lscope_capture(c->scope, x);
+        }
+    }
+    return 1;
+}
+
+/* Site for arithmetic expression v in the lambda body c is compiling, with
+ * the given number of leaves and operators, or NULL if it cannot have one */
+static ljit_site* ljit_site_new(lchunk* c, lval* v, int leaves, int ops) {
+    ljit_site* s = calloc(1, sizeof(ljit_site) + sizeof(ljit_leaf) * leaves);
+    s->expr = v;
+    s->ops = ops;
+    if (!ljit_site_leaves(c, v, s)) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/* Emit the code for v if it needs no task of its own: a symbol, or a value
+ * that is its own, as () is. Empty and single element S-Expressions need
+ * no call, as in lval_eval_sexpr: () is itself and (x) is just x. */
+static int lcomp_leaf(lchunk* c, lval* v) {
+    if (lval_type(v) == LVAL_SYM) {
+        lval_compile_sym(c, v);
+        return 1;
+    }
+    if (lval_type(v) != LVAL_SEXPR || v->count == 0) {
+        lchunk_emit(c, LOP_CONST, (lcode)v);
+        return 1;
+    }
+    return 0;
+}
+
+/* Whether S-Expression v, of four elements, is if still bound to the
+ * builtin and applied to flat literal branches */
+static int lif_form(lchunk* c, lval* v) {
+    lval* k = v->cell[0];
+    if (lval_type(k) != LVAL_SYM || strcmp(k->str, "if") != 0) { return 0; }
+
+    int slot;
+    if (c->scope && lscope_lookup(c->scope, k, &slot) >= 0) { return 0; }
+    lenv_slot* s = lenv_find(c->env, k);
+    if (!s->sym || lval_type(s->val) != LVAL_FUN || s->val->fun != builtin_if) { return 0; }
+
+    for (int i = 2; i < 4; i++) {
+        if (lval_type(v->cell[i]) != LVAL_QEXPR || (v->cell[i]->flags & LFLAG_RRB)) { return 0; }
+    }
+    return 1;
+}
+
+/* Push the tasks for the S-Expression made of the cells of non-empty v,
+ * which is a Q-Expression when it is the body of a lambda or the branch of
+ * an if */
+static void lcomp_sexpr(lchunk* c, lval* v, int tail) {
+    if (v->count == 1) {
+        lcomp_push(LC_EXPR, c, v->cell[0], tail);
+        return;
+    }
+
+    /* (if cond {then} {else}) jumps over the branch it does not take. A
+     * condition that is not a number leaves an error where the then-branch
+     * would have left its value: LOP_IF jumps to the LOP_JUMP over the
+     * else-branch. if itself is pushed first, for LOP_IF to check. */
+    if (v->count == 4 && lif_form(c, v)) {
+        lval_compile_sym(c, v->cell[0]);
+        long land = lcomp_push(LC_LAND, c, NULL, 0);
+        lcomp_push(LC_BRANCH, c, v->cell[3], tail);
+        long jump = lcomp_push(LC_JUMP, c, NULL, 0);
+        lcomp.items[jump].n = land;
+        lcomp_push(LC_BRANCH, c, v->cell[2], tail);
+        long cond = lcomp_push(LC_IF, c, v, tail);
+        lcomp.items[cond].n = jump;
+        lcomp_push(LC_EXPR, c, v->cell[1], 0);
+        return;
+    }
+
+    /* A lambda's body goes in a chunk of its own, and the closure is made
+     * once it is done. \ is pushed first, for LOP_CLOSURE to check. */
+    if (c->scope && llambda_form(c, v)) {
+        lval_compile_sym(c, v->cell[0]);
+        lval* body = lval_share(v->cell[2]);
+        lproto_build* b = lproto_begin(c->env, c->scope, lval_share(v->cell[1]), body);
+        lcomp.items[lcomp_push(LC_CLOSURE, c, NULL, tail)].proto = b;
+        lcomp_push(LC_BRANCH, &b->c, body, 1);
+        return;
+    }
+
+    /* Native code is left to lambda bodies, which run often enough for it
+     * to pay */
+    ljit_site* s = NULL;
+    int arith = 0;
+    if (ljit.enabled && !c->arith && c->scope) {
+        int leaves = 0;
+        int ops = 0;
+        arith = ljit_arith(v, 0, &leaves, &ops);
+        if (arith) { s = ljit_site_new(c, v, leaves, ops); }
+    }
+    if (s) {
+        s->next = c->sites;
+        c->sites = s;
+        lchunk_emit(c, LOP_NATIVE, (lcode)s);
+        s->at = c->count - 1;
+    }
+
+    /* The elements before the first nested one are emitted straight away,
+     * and if that is all of them so is the call */
+    int start = c->count;
+    int i = 0;
+    while (i < v->count && lcomp_leaf(c, v->cell[i])) { i++; }
+    if (i == v->count) {
+        lchunk_emit(c, tail ? LOP_TAILCALL : LOP_CALL, v->count - 1);
+        if (s) { s->skip = c->count - start; }
+        return;
+    }
+
+    lcomp_task* t = &lcomp.items[lcomp_push(LC_CALL, c, NULL, tail)];
+    t->n = v->count - 1;
+    t->at = start;
+    t->arith = arith;
+    t->site = s;
+    c->arith |= arith;
+    for (int j = v->count - 1; j >= i; j--) { lcomp_push(LC_EXPR, c, v->cell[j], 0); }
+}
+
+/* Run the tasks above bottom */
+static void lcomp_run(long bottom) {
+    while (lcomp.count > bottom) {
+        lcomp_task t = lcomp.items[--lcomp.count];
+        lchunk* c = t.c;
+        lval* v = t.v;
+        switch (t.kind) {
+            case LC_EXPR:
+                if (!lcomp_leaf(c, v)) { lcomp_sexpr(c, v, t.tail); }
+                break;
+
+            /* The branch of an if or the body of a lambda, run as eval
+             * would: {} gives () */
+            case LC_BRANCH:
+                if (v->count == 0) {
+                    lchunk_emit(c, LOP_CONST, (lcode)&lnil);
+                } else {
+                    lcomp_sexpr(c, v, t.tail);
+                }
+                break;
+
+            case LC_CALL:
+                lchunk_emit(c, t.tail ? LOP_TAILCALL : LOP_CALL, t.n);
+                if (t.arith) { c->arith = 0; }
+                if (t.site) { t.site->skip = c->count - t.at; }
+                break;
+
+            /* LOP_IF, followed by the call it carries on into if if has
+             * been rebound, and the jump from there over both branches */
+            case LC_IF: {
+                lcomp_task* jump = &lcomp.items[t.n];
+                lchunk_emit(c, LOP_IF, 0);
+                jump->at = c->count;
+                lchunk_emit(c, LOP_CONST, (lcode)v->cell[2]);
+                lchunk_emit(c, LOP_CONST, (lcode)v->cell[3]);
+                lchunk_emit(c, t.tail ? LOP_TAILCALL : LOP_CALL, 3);
+                lchunk_emit(c, LOP_JUMP, 0);
+                lcomp.items[jump->n].n = c->count;
+                break;
+            }
+
+            case LC_JUMP:
+                lchunk_emit(c, LOP_JUMP, 0);
+                c->code[t.at - 1] = c->count - t.at;
+                lcomp.items[t.n].at = c->count;
+                break;
+
+            case LC_LAND:
+                c->code[t.at - 1] = c->count - t.at;
+                c->code[t.n - 1] = c->count - t.n;
+                break;
+
+            case LC_CLOSURE:
+                lval_compile_closure(c, t.proto, t.tail);
+                break;
+        }
+    }
+}
+
+/* Emit the code for v into c, as the task kind: the code that leaves v's
+ * value on top of the stack, or in tail position the code that finishes
+ * with it */
+static void lval_compile(int kind, lchunk* c, lval* v, int tail) {
+    long bottom = lcomp.count;
+    lcomp_push(kind, c, v, tail);
+    lcomp_run(bottom);
+}
+
+lval* llambda_enter(long base, int n);
+
+/* Call the builtin at lvm_stack[base] with the n arguments above it.
+ * Errors among them are passed on, the first one winning, as the tree
+ * walker does. A builtin leaving an expression to evaluate in its place
+ * (see lval_tail) gives LTAIL. */
+static lval* lvm_call(lenv* e, long base, int n) {
+    lval** a = lvm_stack.items + base;
+    for (int i = 0; i <= n; i++) {
+        if (lval_type(a[i]) == LVAL_ERR) { return a[i]; }
+    }
+    if (lval_type(a[0]) != LVAL_FUN) {
+        return lval_err("S-expression does not start with a function!");
+    }
+    return a[0]->fun(e, a + 1, n);
+}
+
+#ifdef LVM_THREADED
+static const char* lvm_dispatch = "threaded";
+#define LVM_DISPATCH goto *(void*)*ip++;
+#define LVM_CASE(op) op_##op
+#define LVM_NEXT goto *(void*)*ip++
+#else
+static const char* lvm_dispatch = "switch";
+#define LVM_DISPATCH while (1) switch (*ip++)
+#define LVM_CASE(op) case op
+#define LVM_NEXT break
+#endif
+
+void lchunk_compile(lchunk* c, lenv* e, lval* v);
+void lchunk_free(lchunk* c);
+
+/* A call the VM returns to when the code it made finishes: where to carry
+ * on, in which lambda's frame, the chunk that code is in if lvm_exec
+ * compiled it, and the stack slot the result goes in */
+typedef struct {
+    lcode* ip;
+    lval* f;
+    long fp;
+    long base;
+    lchunk* chunk;
+} lvm_frame;
+
+static struct {
+    lvm_frame* items;
+    long count;
+    long cap;
+} lvm_frames;
+
+/* Save where to carry on once the call at lvm_stack[base] returns, handing
+ * over the running chunk. Gives NULL, or an error if the stack is full. */
+static lval* lvm_frame_push(lcode* ip, lval* f, long fp, long base, lchunk** chunk) {
+    if (lvm_frames.count >= leval_max_depth) { return leval_too_deep(); }
+    lvm_frames.items = lgrow(lvm_frames.items, lvm_frames.count, &lvm_frames.cap, sizeof(lvm_frame));
+    lvm_frames.items[lvm_frames.count++] = (lvm_frame){ ip, f, fp, base, *chunk };
+    *chunk = NULL;
+    return NULL;
+}
+
+/* Free chunk, if lvm_exec compiled one, along with its root */
+static void lvm_chunk_drop(lchunk* chunk) {
+    if (!chunk) { return; }
+    lchunk_free(chunk);
+    free(chunk);
+    if (gc.enabled) { lgc_pop_root(); }
+}
+
+/* Replace *chunk with the expression a builtin left compiled, which only
+ * sees the globals, and give the code to run */
+static lcode* lvm_chunk_tail(lenv* e, lchunk** chunk) {
+    lvm_chunk_drop(*chunk);
+    lchunk* c = malloc(sizeof(lchunk));
+    lchunk_compile(c, e, ltail_expr);
+    if (gc.enabled) { lgc_push_root(c->src); }
+    *chunk = c;
+    return c->code;
+}
+
+/* Run code from ip, in the frame of lambda f whose arguments start at
+ * lvm_stack[fp], until it returns. Lambdas, and the expressions builtins
+ * leave to evaluate, run here too rather than in a call to lvm_exec of
+ * their own: a call pushes a frame to return to, and a call in tail
+ * position does not, reusing the caller's frame for a lambda and replacing
+ * the code that made it for an expression. */
+static lval* lvm_exec(lenv* e, lcode* ip, lval* f, long fp) {
+#ifdef LVM_THREADED
+    static void* handlers[] = {
+        &&op_LOP_CONST, &&op_LOP_GLOBAL, &&op_LOP_LOCAL, &&op_LOP_FREE, &&op_LOP_CLOSURE,
+        &&op_LOP_CALL, &&op_LOP_TAILCALL, &&op_LOP_IF, &&op_LOP_JUMP, &&op_LOP_NATIVE,
+        &&op_LOP_RETURN
+    };
+    lvm_handlers = handlers;
+    if (ip == NULL) { return NULL; }
+#endif
+
+    /* Frames below this one belong to whoever called */
+    long frames = lvm_frames.count;
+    lchunk* chunk = NULL;
+    lval* x;
+
+    LVM_DISPATCH {
+        LVM_CASE(LOP_CONST):
+            lstack_push(&lvm_stack, (lval*)*ip++);
+            LVM_NEXT;
+
+        LVM_CASE(LOP_GLOBAL): {
+            /* Look the symbol up only if the environment has gained a
+             * binding since its slot was cached. This cache is only in
+             * compiled code: the tree walker, which runs top level
+             * expressions by default, still calls lenv_get every time. */
+            if ((unsigned long)ip[1] != e->version) {
+                lenv_slot* s = lenv_find(e, (lval*)ip[0]);
+                if (!s->sym) {
+                    lstack_push(&lvm_stack, lenv_get(e, (lval*)ip[0]));
+                    ip += 3;
+                    LVM_NEXT;
+                }
+                ip[1] = (lcode)e->version;
+                ip[2] = (lcode)s;
+            }
+            lstack_push(&lvm_stack, ((lenv_slot*)ip[2])->val);
+            ip += 3;
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_LOCAL): {
+            lval* x = lvm_stack.items[fp + *ip++];
+            lstack_push(&lvm_stack, x);
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_FREE):
+            lstack_push(&lvm_stack, lval_captures(f)[*ip++]);
+            LVM_NEXT;
+
+        LVM_CASE(LOP_CLOSURE): {
+            lval* p = (lval*)*ip++;
+            int n = lproto_frees(p)->count;
+            lvm_stack.count -= n;
+            lval* g = lvm_stack.items[lvm_stack.count - 1];
+            if (lval_type(g) != LVAL_FUN || g->fun != builtin_lambda) { LVM_NEXT; }
+
+            lval* x = lval_lambda(p, n);
+            memcpy(lval_captures(x), lvm_stack.items + lvm_stack.count, sizeof(lval*) * n);
+            lvm_stack.items[lvm_stack.count - 1] = x;
+            ip += LCLOSURE_CALL;
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_CALL): {
+            /* Everything the call needs is on the stack, so this is a safe
+             * point to collect */
+            int n = (int)*ip++;
+            if (gc.enabled) { lgc_maybe_collect(); }
+            long base = lvm_stack.count - n - 1;
+            lval* g = lvm_stack.items[base];
+
+            if (lval_type(g) == LVAL_LAMBDA) {
+                x = llambda_enter(base, n);
+                if (x == NULL && (x = lvm_frame_push(ip, f, fp, base, &chunk)) == NULL) {
+                    f = g;
+                    fp = base + 1;
+                    ip = lproto_code(g->proto);
+                    LVM_NEXT;
+                }
+            } else {
+                x = lvm_call(e, base, n);
+                if (x == LTAIL && (x = lvm_frame_push(ip, f, fp, base, &chunk)) == NULL) {
+                    lvm_stack.count = base;
+                    f = NULL;
+                    ip = lvm_chunk_tail(e, &chunk);
+                    LVM_NEXT;
+                }
+            }
+            lvm_stack.items[base] = x;
+            lvm_stack.count = base + 1;
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_TAILCALL): {
+            int n = (int)*ip++;
+            if (gc.enabled) { lgc_maybe_collect(); }
+            long base = lvm_stack.count - n - 1;
+            lval* g = lvm_stack.items[base];
+
+            /* A lambda runs in place of the one making the call */
+            if (lval_type(g) == LVAL_LAMBDA) {
+                x = llambda_enter(base, n);
+                if (x == NULL) {
+                    if (f) {
+                        memmove(lvm_stack.items + fp - 1, lvm_stack.items + base, sizeof(lval*) * (n + 1));
+                        lvm_stack.count = fp + n;
+                    } else {
+                        fp = base + 1;
+                    }
+                    f = g;
+                    ip = lproto_code(g->proto);
+                    LVM_NEXT;
+                }
+                goto ret;
+            }
+
+            /* So does the expression a builtin left */
+            x = lvm_call(e, base, n);
+            if (x != LTAIL) { goto ret; }
+            lvm_stack.count = f ? fp - 1 : base;
+            f = NULL;
+            ip = lvm_chunk_tail(e, &chunk);
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_IF): {
+            lcode d = *ip++;
+            lval* g = lvm_stack.items[lvm_stack.count - 2];
+            if (lval_type(g) != LVAL_FUN || g->fun != builtin_if) { LVM_NEXT; }
+
+            lval* cond = lvm_stack.items[lvm_stack.count - 1];
+            lvm_stack.count--;
+            if (lval_type(cond) != LVAL_NUM) {
+                /* Leave the error as the value of the then-branch */
+                if (lval_type(cond) != LVAL_ERR) { cond = lval_err("Function 'if' passed incorrect type!"); }
+                lvm_stack.items[lvm_stack.count - 1] = cond;
+                ip += d - 2;
+            } else {
+                lvm_stack.count--;
+                ip += lval_numval(cond) == 0 ? d : LIF_CALL;
+            }
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_JUMP): {
+            lcode d = *ip++;
+            ip += d;
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_NATIVE): {
+            ljit_site* s = (ljit_site*)*ip++;
+            lval* x = ljit_run(e, s, f, fp);
+            if (x) {
+                lstack_push(&lvm_stack, x);
+                ip += s->skip;
+            }
+            LVM_NEXT;
+        }
+
+        LVM_CASE(LOP_RETURN):
+            x = lstack_pop(&lvm_stack);
+        ret:
+            lvm_chunk_drop(chunk);
+            if (lvm_frames.count == frames) { return x; }
+            {
+                lvm_frame* r = &lvm_frames.items[--lvm_frames.count];
+                ip = r->ip;
+                f = r->f;
+                fp = r->fp;
+                chunk = r->chunk;
+                lvm_stack.items[r->base] = x;
+                lvm_stack.count = r->base + 1;
+            }
+            LVM_NEXT;
+    }
+}
+
+/* Fill in the handler addresses the compiler emits */
+void lvm_init(void) {
+#ifdef LVM_THREADED
+    lvm_exec(NULL, NULL, NULL, 0);
+#endif
+}
+
+lval* lvm_run(lenv* e, lchunk* c) {
+    /* A call in tail position may finish without clearing the stack */
+    long base = lvm_stack.count;
+    if (gc.enabled) { lgc_push_root(c->src); }
+    lval* x = lvm_exec(e, c->code, NULL, 0);
+    if (gc.enabled) { lgc_pop_root(); }
+    lvm_stack.count = base;
+    return x;
+}
+
+/* Compile v and run it */
+/* The largest code array finished with so far, kept for the next chunk so
+ * that big expressions are not compiled into fresh memory every time */
+static lchunk lvm_spare;
+
+void lchunk_compile(lchunk* c, lenv* e, lval* v) {
+    c->code = lvm_spare.code;
+    c->count = 0;
+    c->cap = lvm_spare.cap;
+    c->src = v;
+    c->sites = NULL;
+    c->arith = 0;
+    c->env = e;
+    c->scope = NULL;
+    lvm_spare.code = NULL;
+    lvm_spare.cap = 0;
+
+    lval_compile(LC_EXPR, c, v, 1);
+    lchunk_emit(c, LOP_RETURN, 0);
+}
+
+void lchunk_free(lchunk* c) {
+    if (c->cap > lvm_spare.cap) {
+        free(lvm_spare.code);
+        lvm_spare.code = c->code;
+        lvm_spare.cap = c->cap;
+    } else {
+        free(c->code);
+    }
+}
+
+lval* lvm_eval(lenv* e, lval* v) {
+    lchunk c;
+    lchunk_compile(&c, e, v);
+    lval* x = lvm_run(e, &c);
+    lchunk_free(&c);
+    return x;
+}
+
+/* Lambdas
+ *
+ * (\ {x y} {+ x y}) makes a function of x and y. Its body is compiled to
+ * bytecode when the lambda is made, with every symbol resolved there and
+ * then to where it is bound: depth lambdas out, in a slot of that lambda's
+ * frame, or nowhere, in which case it is looked up in the global
+ * environment as it runs, once for each time the environment gains a
+ * binding. A call never looks up a name in an environment:
+ * the arguments stay on the VM's stack, where LOP_LOCAL reads the slots of
+ * the lambda's own frame, and there is no chain of frames to walk.
+ *
+ * Closures are flat. A name bound by an enclosing lambda is captured: the
+ * closure gets a copy of its value when it is made, and LOP_FREE reads it
+ * from there. A lambda written in the body of another one is compiled
+ * along with it, and the code around it pushes the values to capture, out
+ * of its own frame or its own captures, before LOP_CLOSURE. That only makes
+ * the closure if \ is still bound to the builtin; otherwise whatever it is
+ * bound to now is called with the formals and body, as it would be outside
+ * a lambda. Bindings never change, so a copy of the value is as good as the
+ * variable. Names only
+ * resolve lexically in lambdas written out in a body; a lambda made some
+ * other way, or code run by eval, only sees its own arguments and the
+ * globals.
+ *
+ * The compiled body is an LVAL_PROTO holding its code inline, and keeping
+ * alive the constants the code points at. It is made in the pools, or in
+ * the old generation under the collector, so that it can outlive the
+ * expression that made it and never moves. Its constants are shared, and
+ * so is everything passed to a lambda, since the body may use each value
+ * more than once: lval_own copies them before anything changes them.
+ *
+ * Lambda bodies always run as bytecode, whether or not top level
+ * expressions do (see leval), and without native code.
+ */
+
+/* How many lambdas out from sc the innermost binding of s is, with its slot
+ * in that lambda's frame, or -1 if s is global */
+static int lscope_lookup(lscope* sc, lval* s, int* slot) {
+    for (int depth = 0; sc; sc = sc->up, depth++) {
+        for (int i = 0; i < sc->formals->count; i++) {
+            if (sc->formals->cell[i] == s) {
+                *slot = i;
+                return depth;
+            }
+        }
+    }
+    return -1;
+}
+
+/* Index among the values sc's closures capture of s, which is bound by an
+ * enclosing lambda */
+static int lscope_capture(lscope* sc, lval* s) {
+    lval* frees = sc->consts->cell[2];
+    for (int i = 0; i < frees->count; i++) {
+        if (frees->cell[i] == s) { return i; }
+    }
+    lval_add(frees, s);
+    return frees->count - 1;
+}
+
+void lval_compile_sym(lchunk* c, lval* s) {
+    int slot = 0;
+    int depth = c->scope ? lscope_lookup(c->scope, s, &slot) : -1;
+    if (depth < 0) {
+        /* Followed by its cache: the version it was filled in and the slot */
+        lchunk_emit(c, LOP_GLOBAL, (lcode)s);
+        lchunk_word(c, 0);
+        lchunk_word(c, 0);
+    } else if (depth == 0) {
+        lchunk_emit(c, LOP_LOCAL, slot);
+    } else {
+        lchunk_emit(c, LOP_FREE, lscope_capture(c->scope, s));
+    }
+}
+
+static int llambda_formals_ok(lval* formals) {
+    for (int i = 0; i < formals->count; i++) {
+        if (lval_type(formals->cell[i]) != LVAL_SYM) { return 0; }
+    }
+    return 1;
+}
+
+/* A symbol named twice among formals, or NULL. Symbols are interned, so
+ * names compare by pointer */
+static lval* llambda_formals_twice(lval* formals) {
+    for (int i = 1; i < formals->count; i++) {
+        for (int j = 0; j < i; j++) {
+            if (formals->cell[i] == formals->cell[j]) { return formals->cell[i]; }
+        }
+    }
+    return NULL;
+}
+
+/* Whether v is a lambda that can be compiled along with the body around it:
+ * \ still bound to the builtin, applied to flat literals */
+int llambda_form(lchunk* c, lval* v) {
+    lval* k = v->cell[0];
+    if (v->count != 3 || lval_type(k) != LVAL_SYM || strcmp(k->str, "\\") != 0) { return 0; }
+
+    int slot;
+    if (lscope_lookup(c->scope, k, &slot) >= 0) { return 0; }
+    lenv_slot* s = lenv_find(c->env, k);
+    if (!s->sym || lval_type(s->val) != LVAL_FUN || s->val->fun != builtin_lambda) { return 0; }
+
+    for (int i = 1; i < 3; i++) {
+        if (lval_type(v->cell[i]) != LVAL_QEXPR || (v->cell[i]->flags & LFLAG_RRB)) { return 0; }
+    }
+    return llambda_formals_ok(v->cell[1]) && !llambda_formals_twice(v->cell[1]);
+}
+
+/* Start compiling the body of a lambda taking formals, inside the scope
+ * up. Takes a reference to formals and body, which are flat and, like
+ * everything made here, must not be in the region or the nursery. */
+static lproto_build* lproto_begin(lenv* e, lscope* up, lval* formals, lval* body) {
+    lproto_build* b = calloc(1, sizeof(lproto_build));
+    b->sc = (lscope){ up, formals, lval_qexpr() };
+    lval_add(b->sc.consts, formals);
+    lval_add(b->sc.consts, body);
+    lval_add(b->sc.consts, lval_qexpr());
+    b->c.env = e;
+    b->c.scope = &b->sc;
+    return b;
+}
+
+/* Words a copy of site s takes up after the code of a compiled body */
+static int lproto_site_words(ljit_site* s) {
+    size_t n = sizeof(ljit_site) + sizeof(ljit_leaf) * s->count;
+    return (n + sizeof(lcode) - 1) / sizeof(lcode);
+}
+
+/* The compiled body b has been building, which is freed */
+static lval* lproto_finish(lproto_build* b) {
+    lchunk* c = &b->c;
+    lchunk_emit(c, LOP_RETURN, 0);
+
+    /* The native code sites go after the code, so that they last as long
+     * as it does, and their LOP_NATIVEs are pointed at them there */
+    int words = c->count;
+    for (ljit_site* s = c->sites; s; s = s->next) { words += lproto_site_words(s); }
+
+    lval* p = lval_alloc(LVAL_PROTO, offsetof(lval, str) + sizeof(lcode) * words);
+    p->count = words;
+    p->refs = 1;
+    p->consts = b->sc.consts;
+    memcpy(lproto_code(p), c->code, sizeof(lcode) * c->count);
+
+    lcode* at = lproto_code(p) + c->count;
+    while (c->sites) {
+        ljit_site* s = c->sites;
+        c->sites = s->next;
+        int n = lproto_site_words(s);
+        memcpy(at, s, sizeof(ljit_site) + sizeof(ljit_leaf) * s->count);
+        lproto_code(p)[s->at] = (lcode)at;
+        at += n;
+        free(s);
+    }
+
+    free(c->code);
+    free(b);
+    return p;
+}
+
+/* Emit the code making a closure of the lambda whose body b has just been
+ * compiled, followed by the call of \ made instead if it has been rebound.
+ * The body around it keeps the compiled body alive. */
+static void lval_compile_closure(lchunk* c, lproto_build* b, int tail) {
+    lval* p = lproto_finish(b);
+    lval_add(c->scope->consts, p);
+
+    lval* frees = lproto_frees(p);
+    for (int i = 0; i < frees->count; i++) { lval_compile_sym(c, frees->cell[i]); }
+    lchunk_emit(c, LOP_CLOSURE, (lcode)p);
+    lchunk_emit(c, LOP_CONST, (lcode)lproto_formals(p));
+    lchunk_emit(c, LOP_CONST, (lcode)lproto_body(p));
+    lchunk_emit(c, tail ? LOP_TAILCALL : LOP_CALL, 2);
+}
+
+/* Check the n arguments above the lambda at lvm_stack[base] and share them
+ * with its body, giving NULL if it can be run with them or the error to
+ * give instead */
+lval* llambda_enter(long base, int n) {
+    lval** a = lvm_stack.items + base;
+    for (int i = 1; i <= n; i++) {
+        if (lval_type(a[i]) == LVAL_ERR) { return a[i]; }
+    }
+    int params = lproto_formals(a[0]->proto)->count;
+    LASSERT((n == params), "Function passed %i arguments, expected %i!", n, params);
+
+    for (int i = 1; i <= n; i++) { lgc_share(a[i]); }
+    return NULL;
+}
+
+/* Call the lambda at lvm_stack[base] with the n arguments above it, which
+ * are its frame */
+lval* llambda_call(lenv* e, long base, int n) {
+    lval* x = llambda_enter(base, n);
+    if (x) { return x; }
+    lval* f = lvm_stack.items[base];
+    return lvm_exec(e, lproto_code(f->proto), f, base + 1);
+}
+
+/* A long lived copy of v for a compiled body to keep */
+static lval* llambda_keep(lval* v) {
+    return gc.enabled ? lval_copy(v) : lval_promote(v);
+}
+
+lval* builtin_lambda(lenv* e, lval** a, int n) {
+    LASSERT((n == 2), "Function '\\' passed incorrect number of arguments!");
+
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR && lval_type(a[1]) == LVAL_QEXPR),
+        "Function '\\' passed incorrect type!");
+
+    lval* formals = lval_flat(a[0]);
+    LASSERT(llambda_formals_ok(formals), "Function '\\' cannot take non-symbol!");
+    lval* twice = llambda_formals_twice(formals);
+    LASSERT(!twice, "Function '\\' cannot take symbol '%s' twice!", twice->str);
+    lval* body = lval_flat(a[1]);
+
+    /* The compiled body and its constants go in the pools or the old
+     * generation */
+    int active = region.active;
+    region.active = 0;
+    gc.tenure = 1;
+    body = llambda_keep(body);
+    lproto_build* b = lproto_begin(e, NULL, llambda_keep(formals), body);
+    lval_compile(LC_BRANCH, &b->c, body, 1);
+    lval* p = lproto_finish(b);
+    if (gc.enabled) { lgc_share(p); }
+    region.active = active;
+    gc.tenure = 0;
+
+    /* The closure holds its own reference unless it is in the region, in
+     * which case it borrows p until the region ends */
+    lval* f = lval_lambda(p, 0);
+    lregion_defer_release(p);
+    return f;
+}
+
+lval* builtin_def(lenv* e, lval** a, int n) {
+    LASSERT((lval_type(a[0]) == LVAL_QEXPR), "Function 'def' passed incorrect type!");
+
+    /* First arg is a symbol list*/
+    lval* syms = lval_flat(a[0]);
+
+    /* Make sure all memebers of syms is in fact a symbol */
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT((lval_type(syms->cell[i]) == LVAL_SYM), "Function 'def' cannot define non-symbol!");
+    }
+
+    /* Check for correct number of symbols and values */
+    LASSERT((syms->count == n-1), "Function 'def' cannot define incorrect number of values to symbols!");
+
+    /* Assign copies to symbols */
+    for (int i = 0; i < syms->count; i++) {
+        lenv_put(e, syms->cell[i], a[i+1]);
+    }
+
+    return lval_sexpr();
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* key = lval_sym(name);
+    lval* value = lval_fun(func);
+    lenv_put(e, key, value);
+    lval_del(key);
+    lval_del(value);
 }
 
 void lenv_add_builtins(lenv* e) {
@@ -584,16 +5174,538 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
     lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "slice", builtin_slice);
 
     lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "if", builtin_if);
 
     /* Math functions */
     lenv_add_builtin(e, "+", builtin_add);
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "%", builtin_mod);
+    lenv_add_builtin(e, "min", builtin_min);
+    lenv_add_builtin(e, "max", builtin_max);
+
+    /* Comparison functions */
+    lenv_add_builtin(e, "<", builtin_lt);
+    lenv_add_builtin(e, ">", builtin_gt);
+    lenv_add_builtin(e, "<=", builtin_le);
+    lenv_add_builtin(e, ">=", builtin_ge);
+    lenv_add_builtin(e, "==", builtin_eq);
+    lenv_add_builtin(e, "!=", builtin_ne);
+
+    /* Vector functions */
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vec-list", builtin_vec_list);
+    lenv_add_builtin(e, "vec-add", builtin_vec_add);
+    lenv_add_builtin(e, "vec-mul", builtin_vec_mul);
+    lenv_add_builtin(e, "vec-sum", builtin_vec_sum);
+    lenv_add_builtin(e, "vec-dot", builtin_vec_dot);
+    lenv_add_builtin(e, "vec-filter", builtin_vec_filter);
+}
+
+
+/* Free the environment and everything the allocators are holding on to */
+void lshutdown(lenv* e) {
+    lenv_del(e);
+    lgc_cleanup();
+    lstack_free(&lvm_stack);
+    free(lvm_spare.code);
+    free(lvm_frames.items);
+    free(leval_stack.items);
+    free(lread_stack.items);
+    free(lcomp.items);
+    free(lwalk.items);
+    free(lhcons.items);
+    ljit_cleanup();
+    lregion_cleanup();
+    lval_alloc_cleanup();
+    lintern_cleanup();
+}
+
+/* Benchmarks
+ *
+ * Run with --bench, adding --vm to time compiling top level expressions too.
+ * Each case is parsed once, then read and evaluated inside a fresh region for
+ * every repetition, reporting the region bytes one repetition needed and the
+ * time it took.
+ */
+
+/* Source for a Q-Expression of n elements, each produced by fmt from its index */
+char* lbench_list(char* open, char* fmt, int n, char* close) {
+    size_t size = strlen(open) + strlen(close) + 1;
+    char item[64];
+    for (int i = 0; i < n; i++) { size += snprintf(item, sizeof(item), fmt, i) + 1; }
+
+    char* src = malloc(size);
+    char* p = src + sprintf(src, "%s", open);
+    for (int i = 0; i < n; i++) { p += sprintf(p, fmt, i); *p++ = ' '; }
+    strcpy(p, close);
+    return src;
+}
+
+void lbench_case(mpc_parser_t* parser, lenv* e, char* name, char* src, int n, int reps) {
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", src, parser, &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return;
+    }
+
+    long bytes = 0;
+    clock_t start = clock();
+    for (int i = 0; i < reps; i++) {
+        leval_begin();
+        leval(e, lval_read(r.output));
+        bytes = gc.enabled ? gc.nursery.used : region.mem.used;
+        leval_end();
+    }
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%-14s %8i elems %10li bytes %7.1f bytes/elem %9.3f ms/rep %8.2f Melems/s\n",
+        name, n, bytes, (double)bytes / n, secs * 1000 / reps, (double)n * reps / secs / 1e6);
+    mpc_ast_delete(r.output);
+}
+
+/* Time evaluating src with the VM, the VM with the JIT when there is one,
+ * and the tree walker, leaving out reading it. Compiling is timed on its own
+ * so that the VM's run time shows what its dispatch costs against the tree
+ * walker's recursion. */
+void lbench_dispatch(mpc_parser_t* parser, lenv* e, char* name, char* src, int calls, int reps) {
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", src, parser, &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return;
+    }
+
+    int jit = ljit.enabled;
+    for (int mode = 0; mode < 3; mode++) {
+        int tree = mode == 2;
+        if (mode == 1 && !jit) { continue; }
+        ljit.enabled = mode == 1;
+
+        double compile = 0;
+        double run = 0;
+        for (int i = 0; i < reps; i++) {
+            leval_begin();
+            lval* v = lval_read(r.output);
+            clock_t start = clock();
+            if (tree) {
+                lval_eval(e, v);
+                run += (double)(clock() - start) / CLOCKS_PER_SEC;
+            } else {
+                lchunk c;
+                lchunk_compile(&c, e, v);
+                clock_t compiled = clock();
+                lvm_run(e, &c);
+                compile += (double)(compiled - start) / CLOCKS_PER_SEC;
+                run += (double)(clock() - compiled) / CLOCKS_PER_SEC;
+                lchunk_free(&c);
+            }
+            leval_end();
+        }
+        printf("%-14s %8i calls %9.3f ms/rep compiling %9.3f ms/rep running %8.2f Mcalls/s (%s)\n",
+            name, calls, compile * 1000 / reps, run * 1000 / reps,
+            (double)calls * reps / run / 1e6, tree ? "tree" : mode ? "jit" : lvm_dispatch);
+    }
+    ljit.enabled = jit;
+    mpc_ast_delete(r.output);
+}
+
+/* Evaluate src reps times, returning the seconds it took or -1 if it
+ * does not parse */
+double lbench_eval(mpc_parser_t* parser, lenv* e, char* src, int reps) {
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", src, parser, &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return -1;
+    }
+
+    clock_t start = clock();
+    for (int i = 0; i < reps; i++) {
+        leval_begin();
+        leval(e, lval_read(r.output));
+        leval_end();
+    }
+    mpc_ast_delete(r.output);
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* Time joining, slicing and indexing a long list bound by def, first as a
+ * flat list, which every join has to copy, and then backed by a tree */
+void lbench_rrb(mpc_parser_t* parser, lenv* e, char* def, int reps) {
+    char* cases[][2] = {
+        { "rrb-join", "len (join big {1})" },
+        { "rrb-split", "len (join (slice big 100 60000) (slice big 1 90))" },
+        { "rrb-nth", "nth (join {0} big) 50000" },
+    };
+
+    int enabled = lrrb_enabled;
+    for (int mode = 0; mode < 2; mode++) {
+        lrrb_enabled = mode;
+        lbench_eval(parser, e, def, 1);
+        for (int k = 0; k < (int)(sizeof(cases) / sizeof(cases[0])); k++) {
+            double secs = lbench_eval(parser, e, cases[k][1], reps);
+            printf("%-14s %9.3f ms/rep (%s)\n", cases[k][0], secs * 1000 / reps, mode ? "rrb" : "flat");
+        }
+    }
+
+    /* A tree built by thousands of joins, each putting a short list in
+     * the middle of the last, and how tall that left it */
+    lrrb_enabled = 1;
+    lbench_eval(parser, e, "def {lbench-grow} (\\ {n q} {if (> n 0) "
+        "{lbench-grow (- n 1) (join (slice q 0 (/ (len q) 2)) {n n n} (slice q (/ (len q) 2) (len q)))} {q}})", 1);
+    double secs = lbench_eval(parser, e, "def {grown} (lbench-grow 20000 {0})", 1);
+    lval* k = lval_sym("grown");
+    lval* grown = lenv_get(e, k);
+    lval_del(k);
+    int height = (grown->flags & LFLAG_RRB) ? grown->root->height : 0;
+    int least = 0;
+    for (long size = LRRB_BRANCH; size < grown->count; size *= LRRB_BRANCH) { least++; }
+    printf("%-14s %9.3f ms (%i elements, height %i, at least %i)\n",
+        "rrb-grow", secs * 1000, grown->count, height, least);
+    lrrb_enabled = enabled;
+}
+
+/* Check the kernels on results at the edges of the range: products that
+ * overflow along the way and come back in range, and a subtraction of
+ * exactly LSIMD_MIN arguments, which goes the same way as a sum of them */
+static void lbench_reduce_check(void) {
+    long top = -4611686018427387904L;
+    struct { char* name; lkernel k; long args[5]; int n; long want; int fits; } checks[] = {
+        { "* -2^62 -2 -1", lnum_mul, { top, -2, -1 }, 3, LONG_MIN, 1 },
+        { "* -2^62 -2 1 -1 1", lnum_mul, { top, -2, 1, -1, 1 }, 5, LONG_MIN, 1 },
+        { "* -2^62 -2 -1 -1", lnum_mul, { top, -2, -1, -1 }, 4, 0, 0 },
+        { "* -2^62 -2 -1 3", lnum_mul, { top, -2, -1, 3 }, 4, 0, 0 },
+        { "* -2^62 4 0", lnum_mul, { top, 4, 0 }, 3, 0, 1 },
+    };
+
+    int failed = 0;
+    for (int c = 0; c < (int)(sizeof(checks) / sizeof(checks[0])); c++) {
+        lval* a[5];
+        for (int i = 0; i < checks[c].n; i++) { a[i] = lval_num(checks[c].args[i]); }
+        lval* x = checks[c].k(a, checks[c].n);
+        int ok = checks[c].fits ? lval_type(x) == LVAL_NUM && lval_numval(x) == checks[c].want
+                                : lval_type(x) == LVAL_ERR;
+        if (!ok) {
+            printf("reduce-check   %s: wrong result\n", checks[c].name);
+            failed++;
+        }
+        lval_del(x);
+    }
+
+    lval* a[LSIMD_MIN];
+    for (int i = 0; i < LSIMD_MIN; i++) { a[i] = lval_num(i); }
+    lval* x = lnum_sub(a, LSIMD_MIN);
+    if (lval_numval(x) != -(LSIMD_MIN - 1) * LSIMD_MIN / 2) {
+        printf("reduce-check   - over %i args: wrong result\n", LSIMD_MIN);
+        failed++;
+    }
+    lval_del(x);
+    printf("%-14s %8s (%s)\n", "reduce-check", failed ? "FAILED" : "ok", lsimd.name);
+}
+
+/* Time each reduction kernel over n immediates, with the vector reductions
+ * this CPU has and then with the scalar kernels alone */
+void lbench_reduce(int n, int reps) {
+    lval** a = malloc(sizeof(lval*) * n);
+    /* No zeros, so that the product overflows and the scan for a zero that
+     * could still save it has to look at every argument */
+    for (int i = 0; i < n; i++) { a[i] = lval_num(i % 1000 - 500 ? i % 1000 - 500 : 1); }
+
+    struct { char* name; lkernel k; } kernels[] = {
+        { "reduce-add", lnum_add }, { "reduce-sub", lnum_sub },
+        { "reduce-mul", lnum_mul }, { "reduce-min", lnum_min },
+        { "reduce-max", lnum_max },
+    };
+    const char* name = lsimd.name;
+    lsimd_sum_fn sum = lsimd.sum;
+    lsimd_cmp_fn minmax = lsimd.minmax;
+    lsimd_zero_fn has_zero = lsimd.has_zero;
+
+    for (int mode = 0; mode < 2; mode++) {
+        if (mode == 1 && !sum) { break; }
+        if (mode == 1) {
+            lsimd.name = "scalar";
+            lsimd.sum = NULL;
+            lsimd.minmax = NULL;
+            lsimd.has_zero = NULL;
+        }
+        lbench_reduce_check();
+        for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+            clock_t start = clock();
+            for (int i = 0; i < reps; i++) { lval_del(kernels[k].k(a, n)); }
+            double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("%-14s %8i args %9.3f ms/rep %8.2f Margs/s (%s)\n",
+                kernels[k].name, n, secs * 1000 / reps, (double)n * reps / secs / 1e6, lsimd.name);
+        }
+    }
+
+    lsimd.name = name;
+    lsimd.sum = sum;
+    lsimd.minmax = minmax;
+    lsimd.has_zero = has_zero;
+    for (int i = 0; i < n; i++) { lval_del(a[i]); }
+    free(a);
+}
+
+/* Time each vector kernel over n packed numbers, with the AVX2 kernels when
+ * this CPU has them and then with the scalar ones */
+void lbench_vec(int n, int reps) {
+    long* x = malloc(sizeof(long) * n);
+    long* y = malloc(sizeof(long) * n);
+    long* out = malloc(sizeof(long) * n);
+    for (int i = 0; i < n; i++) {
+        x[i] = i % 1000 - 500;
+        y[i] = i % 7 - 3;
+    }
+
+    char* names[] = { "vec-add", "vec-mul", "vec-sum", "vec-dot", "vec-filter" };
+    lvec_zip_fn add = lvec.add;
+    lvec_zip_fn mul = lvec.mul;
+    lvec_sum_fn sum = lvec.sum;
+    lvec_dot_fn dot = lvec.dot;
+    lvec_filter_fn filter = lvec.filter;
+
+    for (int mode = 0; mode < 2; mode++) {
+        if (mode == 1 && sum == lvec_sum_scalar) { break; }
+        if (mode == 1) {
+            lvec.add = lvec_add_scalar;
+            lvec.mul = lvec_mul_scalar;
+            lvec.sum = lvec_sum_scalar;
+            lvec.dot = lvec_dot_scalar;
+            lvec.filter = lvec_filter_scalar;
+        }
+        for (int k = 0; k < 5; k++) {
+            long s;
+            clock_t start = clock();
+            for (int i = 0; i < reps; i++) {
+                switch (k) {
+                    case 0: lvec.add(x, y, out, n); break;
+                    case 1: lvec.mul(x, y, out, n); break;
+                    case 2: lvec.sum(x, n, &s); break;
+                    case 3: lvec.dot(x, y, n, &s); break;
+                    case 4: lvec.filter(x, n, LVEC_GT, 0, out); break;
+                }
+            }
+            double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("%-14s %8i nums %9.3f ms/rep %8.2f Mnums/s (%s)\n",
+                names[k], n, secs * 1000 / reps, (double)n * reps / secs / 1e6,
+                lvec.sum == lvec_sum_scalar ? "scalar" : "avx2");
+        }
+    }
+
+    lvec.add = add;
+    lvec.mul = mul;
+    lvec.sum = sum;
+    lvec.dot = dot;
+    lvec.filter = filter;
+    free(x);
+    free(y);
+    free(out);
+}
+
+/* Time copying, comparing and releasing a wide tree, n short lists in one
+ * long one, and a deep one, n lists each holding the next. Only pool values
+ * are released one by one, so this is skipped under the collector. */
+void lbench_walk(int n, int reps) {
+    if (gc.enabled) { return; }
+
+    lval* wide = lval_qexpr();
+    lval* deep = lval_qexpr();
+    for (int i = 0; i < n; i++) {
+        lval* x = lval_qexpr();
+        lval_add(x, lval_num(i));
+        lval_add(x, lval_num(1));
+        lval_add(x, lval_num(2));
+        lval_add(wide, x);
+
+        x = lval_qexpr();
+        lval_add(x, lval_num(i));
+        deep = lval_add(x, deep);
+    }
+
+    lval* trees[] = { wide, deep };
+    char* names[][3] = { { "copy-wide", "eq-wide", "del-wide" }, { "copy-deep", "eq-deep", "del-deep" } };
+    for (int t = 0; t < 2; t++) {
+        double secs[3] = { 0, 0, 0 };
+        for (int i = 0; i < reps; i++) {
+            clock_t start = clock();
+            lval* x = lval_copy(trees[t]);
+            clock_t copied = clock();
+            lval_eq(x, trees[t]);
+            clock_t compared = clock();
+            lval_del(x);
+            secs[0] += (double)(copied - start) / CLOCKS_PER_SEC;
+            secs[1] += (double)(compared - copied) / CLOCKS_PER_SEC;
+            secs[2] += (double)(clock() - compared) / CLOCKS_PER_SEC;
+        }
+        for (int k = 0; k < 3; k++) {
+            printf("%-14s %8i lists %9.3f ms/rep %8.2f Mlists/s\n",
+                names[t][k], n, secs[k] * 1000 / reps, (double)n * reps / secs[k] / 1e6);
+        }
+    }
+    lval_del(wide);
+    lval_del(deep);
+}
+
+/* Time comparing a list of n numbers with an equal copy, which goes a
+ * block at a time, and then comparing two wide trees that only differ in
+ * their last element, first walking them and then with == once their
+ * hashes are known */
+void lbench_equal(int n, int reps) {
+    if (gc.enabled) { return; }
+
+    lval* nums = lval_qexpr();
+    lval* wide = lval_qexpr();
+    for (int i = 0; i < n; i++) {
+        lval_add(nums, lval_num(i));
+        lval* x = lval_qexpr();
+        lval_add(x, lval_num(i));
+        lval_add(x, lval_num(1));
+        lval_add(wide, x);
+    }
+    lval* other = lval_copy(wide);
+    lval* last = other->cell[n - 1];
+    lval_pop(last, 1);
+    lval_add(last, lval_num(2));
+    lval* args[] = { wide, other };
+
+    double secs[3] = { 0, 0, 0 };
+    for (int i = 0; i < reps; i++) {
+        lval* x = lval_copy(nums);
+        clock_t start = clock();
+        lval_eq(x, nums);
+        clock_t compared = clock();
+        lval_eq(wide, other);
+        secs[0] += (double)(compared - start) / CLOCKS_PER_SEC;
+        secs[1] += (double)(clock() - compared) / CLOCKS_PER_SEC;
+        lval_del(x);
+    }
+
+    /* The first comparison works the hashes out, the rest reuse them */
+    for (int i = 0; i < reps; i++) {
+        clock_t start = clock();
+        lval_del(builtin_eq(NULL, args, 2));
+        secs[2] += (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+
+    char* names[] = { "eq-numbers", "eq-walk", "eq-hashed" };
+    for (int k = 0; k < 3; k++) {
+        printf("%-14s %8i elems %9.3f ms/rep\n", names[k], n, secs[k] * 1000 / reps);
+    }
+    lval_del(nums);
+    lval_del(wide);
+    lval_del(other);
+}
+
+/* Time binding the same configuration fragment under n names, without and
+ * then with hash-consing, and count the pool lvals each leaves live. Pool
+ * values are only bound outside the collector, so this is skipped under it. */
+void lbench_hcons(mpc_parser_t* parser, lenv* e, int n) {
+    if (gc.enabled) { return; }
+
+    char src[128];
+    int enabled = lhcons_enabled;
+    for (int mode = 0; mode < 2; mode++) {
+        lhcons_enabled = mode;
+        lpool_stats before, after, cells;
+        lval_alloc_stats(&before, &cells);
+        double secs = 0;
+        for (int i = 0; i < n; i++) {
+            sprintf(src, "def {lbench-cfg%i-%i} {{host {a b c}} {port 80} {opts {1 2 3 4 5 6 7 8}}}", mode, i);
+            secs += lbench_eval(parser, e, src, 1);
+        }
+        lval_alloc_stats(&after, &cells);
+        printf("%-14s %8i defs %10li lvals %9.3f us/def (%s)\n", "hash-cons", n,
+            after.live - before.live, secs * 1e6 / n, mode ? "shared" : "copied");
+    }
+    lhcons_enabled = enabled;
 }
 
+void lbench(mpc_parser_t* parser, lenv* e) {
+    int n = 100000;
+    printf("sizeof(lval): %i bytes\n", (int)sizeof(lval));
+
+    char* nums = lbench_list("{", "%i", n, "}");
+    char* syms = lbench_list("{", "s%i", n, "}");
+    char* lists = lbench_list("{", "(%i)", n, "}");
+    char* sum = lbench_list("eval (join {+} {", "%i", n / 10, "})");
+    char* len = lbench_list("len (tail {", "s%i", n, "})");
+    char* arith = lbench_list("+", " (- (* %i 3) 1)", n / 10, "");
+
+    /* The short lists typed at the prompt, which fit in inline cells */
+    char* small = lbench_list("{", "{%i 1 2}", n, "}");
+    char* repl = lbench_list("+", " (len (join {%i} {1 2}))", n / 10, "");
+    char* calls = lbench_list("+", " (lbench-add %i 1)", n / 10, "");
+    char* poly = lbench_list("+", " (lbench-poly %i 3)", n / 10, "");
+
+    /* A thousand tails taken one after the other. Each tail is a view, so
+     * nearly all of the time goes on reading the list. Built with -O2, the
+     * median is about 20 ms a repetition, where copying tails took 44, and
+     * 25 against 46 under --gc. Single runs vary by 2x on a loaded machine */
+    int depth = 1000;
+    char* open = malloc(depth * 6 + 2);
+    char* close = malloc(depth + 2);
+    close[0] = '}';
+    for (int i = 0; i < depth; i++) {
+        memcpy(open + i * 6, "(tail ", 6);
+        close[i + 1] = ')';
+    }
+    strcpy(open + depth * 6, "{");
+    close[depth + 1] = '\0';
+    char* tails = lbench_list(open, "s%i", n, close);
+    char* big = lbench_list("def {big} (join {", "%i", n, "} {})");
+
+    lbench_case(parser, e, "numbers", nums, n, 20);
+    lbench_case(parser, e, "symbols", syms, n, 20);
+    lbench_case(parser, e, "nested", lists, n, 20);
+    lbench_case(parser, e, "sum", sum, n / 10, 20);
+    lbench_case(parser, e, "len-tail", len, n, 20);
+    lbench_case(parser, e, "tails", tails, n, 20);
+    lbench_case(parser, e, "small-lists", small, n, 20);
+    lbench_case(parser, e, "repl", repl, n / 10, 20);
+    lbench_dispatch(parser, e, "arith", arith, 2 * (n / 10) + 1, 20);
+    lbench_eval(parser, e, "def {lbench-add} (\\ {x y} {+ x y})", 1);
+    lbench_dispatch(parser, e, "lambda", calls, 2 * (n / 10) + 1, 20);
+
+    /* Arithmetic in a lambda body, which is where native code goes */
+    lbench_eval(parser, e, "def {lbench-poly} (\\ {x y} {+ (* x x) (* 2 x y) (- y 1)})", 1);
+    lbench_dispatch(parser, e, "lambda-arith", poly, 5 * (n / 10) + 1, 20);
+
+    /* A loop written as a tail call, making three calls a time round */
+    char loop[64];
+    sprintf(loop, "lbench-loop %i", n);
+    lbench_eval(parser, e, "def {lbench-loop} (\\ {n} {if (> n 0) {lbench-loop (- n 1)} {n}})", 1);
+    lbench_dispatch(parser, e, "tail-loop", loop, 3 * n + 1, 20);
+    lbench_rrb(parser, e, big, 200);
+    lbench_reduce(n, 200);
+    lbench_vec(n, 200);
+    lbench_walk(n, 50);
+    lbench_equal(n, 50);
+    lbench_hcons(parser, e, n / 100);
+
+    free(nums);
+    free(syms);
+    free(lists);
+    free(sum);
+    free(len);
+    free(arith);
+    free(small);
+    free(repl);
+    free(calls);
+    free(poly);
+    free(open);
+    free(close);
+    free(tails);
+    free(big);
+}
 
 int main(int argc, char** argv) {
 
@@ -609,7 +5721,7 @@ int main(int argc, char** argv) {
     mpca_lang(MPCA_LANG_DEFAULT,
       "                                                     \
         number   : /-?[0-9]+/ ;                             \
-        symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;         \
+        symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;        \
         sexpr    : '(' <expr>* ')' ;                        \
         qexpr    : '{' <expr>* '}' ;                        \
         expr     : <number> | <symbol> | <sexpr> | <qexpr>; \
@@ -617,24 +5729,66 @@ int main(int argc, char** argv) {
       ",
       Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
 
+    /* --stats prints the allocator counters when the session ends,
+     * --gc switches from evaluation regions to the tracing collector,
+     * --vm compiles top level expressions as well as lambda bodies,
+     * --tree walks them, which is the default,
+     * --no-jit leaves hot arithmetic under --vm to the VM,
+     * --rrb backs long Q-Expressions with persistent trees,
+     * --hash-cons shares one copy of each distinct list def binds,
+     * --max-depth n limits how deep evaluation goes (see leval_max_depth) */
+    int show_stats = 0;
+    int bench = 0;
+    int use_gc = 0;
+    int no_jit = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) { show_stats = 1; }
+        if (strcmp(argv[i], "--bench") == 0) { bench = 1; }
+        if (strcmp(argv[i], "--gc") == 0) { use_gc = 1; }
+        if (strcmp(argv[i], "--vm") == 0) { lvm_top = 1; }
+        if (strcmp(argv[i], "--tree") == 0) { lvm_top = 0; }
+        if (strcmp(argv[i], "--rrb") == 0) { lrrb_enabled = 1; }
+        if (strcmp(argv[i], "--hash-cons") == 0) { lhcons_enabled = 1; }
+        if (strcmp(argv[i], "--no-jit") == 0) { no_jit = 1; }
+        if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) { leval_max_depth = atol(argv[++i]); }
+    }
+
+    lenv* e = lenv_new();
+    if (use_gc) { lgc_enable(e); }
+    if (!no_jit) { ljit_enable(); }
+    lsimd_init();
+    lvec_init();
+    lvm_init();
+    lenv_add_builtins(e);
+
+    /* --bench runs the benchmarks instead of the REPL */
+    if (bench) {
+        lbench(Lispy, e);
+        lshutdown(e);
+        mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+        return 0;
+    }
+
     /* Print Version and Exit Information */
     puts("Lispy Version 0.0.4");
     puts("Press Ctrl+c to Exit");
     puts("And as always, have fun!\n");
 
-    lenv* e = lenv_new();
-    lenv_add_builtins(e);
-
     while(1) {
         char* input = readline("crispy> ");
+
+        /* Ctrl+d ends the session */
+        if (input == NULL) { break; }
         add_history(input);
 
         mpc_result_t r;
         if (mpc_parse("<stdin>", input, Lispy, &r)) {
 
-            lval* x = lval_eval(e, lval_read(r.output));
+            /* Temporaries made while evaluating go once it is printed */
+            leval_begin();
+            lval* x = leval(e, lval_read(r.output));
             lval_println(x);
-            lval_del(x);
+            leval_end();
 
             mpc_ast_delete(r.output);
         } else {
@@ -644,7 +5798,14 @@ int main(int argc, char** argv) {
         }
         free(input);
     }
-    lenv_del(e);
+    if (show_stats) {
+        lval_alloc_stats_print();
+        lregion_stats_print();
+        lgc_stats_print();
+        ljit_stats_print();
+        lhcons_stats_print();
+    }
+    lshutdown(e);
     mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
     return 0;
 }